@@ -0,0 +1,123 @@
+/*
+ * Mud Client Test Server. Copyright 2006, 2007, 2009 Sebastian Andersson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A log-linear histogram for latencies, sizes and such.
+ *
+ * Every power of two is split into HIST_SUB buckets, so a value read
+ * back from the histogram is never more than 1/HIST_SUB off.
+ * Adding a value is a few instructions and never allocates memory.
+ */
+#ifndef MCTS_HISTOGRAM_H
+#define MCTS_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} histogram;
+
+static inline int
+hist_index(uint64_t value)
+{
+    int msb, shift;
+    if(value < HIST_SUB)
+        return (int)value;
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((value >> shift) & (HIST_SUB - 1));
+}
+
+/* The value in the middle of a bucket */
+static inline uint64_t
+hist_value(int index)
+{
+    int shift;
+    uint64_t low;
+    if(index < HIST_SUB)
+        return index;
+    shift = index / HIST_SUB - 1;
+    low = (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+    return low + (((uint64_t)1 << shift) - 1) / 2;
+}
+
+static inline void
+hist_clear(histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static inline void
+hist_add(histogram *h, uint64_t value)
+{
+    if(!h->count || value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[hist_index(value)]++;
+}
+
+static inline void
+hist_merge(histogram *to, const histogram *from)
+{
+    int i;
+    if(!from->count) return;
+    if(!to->count || from->min < to->min) to->min = from->min;
+    if(from->max > to->max) to->max = from->max;
+    to->count += from->count;
+    to->sum += from->sum;
+    for(i = 0; i < HIST_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+}
+
+/* percentile is 0 - 100, for example 99.9 */
+static inline uint64_t
+hist_percentile(const histogram *h, double percentile)
+{
+    uint64_t wanted, seen = 0;
+    int i;
+    if(!h->count) return 0;
+    wanted = (uint64_t)(h->count * percentile / 100.0 + 0.5);
+    if(wanted < 1) wanted = 1;
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen >= wanted) {
+            uint64_t value = hist_value(i);
+            if(value > h->max) return h->max;
+            if(value < h->min) return h->min;
+            return value;
+        }
+    }
+    return h->max;
+}
+
+static inline uint64_t
+hist_mean(const histogram *h)
+{
+    return h->count ? h->sum / h->count : 0;
+}
+
+#endif
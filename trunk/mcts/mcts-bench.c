@@ -0,0 +1,908 @@
+/*
+ * Mud Client Test Server. Copyright 2006, 2007, 2009 Sebastian Andersson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * mcts-bench - a load generator for the MUD client test server.
+ *
+ * It opens a number of telnet connections to the server from one
+ * process, answers the server's option negotiation like a simple mud
+ * client would (optionally with MCCP), and then sends command lines at
+ * a given rate. The server ends every prompt with IAC EOR, so the time
+ * from a sent command to the next IAC EOR is the command's round trip.
+ *
+ * With -Z the server is asked to send ZMP "mcts.echo" messages, which
+ * are sent back at once, so the server can time them; the time from
+ * when the server sent one until it arrived is also shown.
+ *
+ * With -F one more connection sends a command over and over, without
+ * waiting for the prompts, to see how much a heavy client slows down
+ * the others. Its commands are counted apart from theirs.
+ *
+ * With -k the commands are typed: the server is asked to echo, and
+ * every command is sent a few characters at a time, the next piece
+ * when the echo of the last one has come back. The time until the
+ * echo came and the number of reads it took are shown.
+ *
+ * With -C it instead measures how many connections per second the
+ * server can set up: every connection is closed as soon as the option
+ * negotiation is done and a new one is opened in its place.
+ *
+ * Compile with:
+ *   gcc -g -Wall -DHAVE_ZLIB mcts-bench.c -o mcts-bench -lz
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "histogram.h"
+
+/* Telnet constants */
+#define IACc  '\377'
+#define DONTc '\376'
+#define DOc   '\375'
+#define WONTc '\374'
+#define WILLc '\373'
+#define SBc   '\372'
+#define SEc   '\360'
+#define EORc  '\357'	/* The END-OF-RECORD command */
+#define ECHOc '\001'
+#define TTc   '\030'
+#define EOR_OPTc '\031'
+#define NAWSc '\037'
+#define CHARSETc '\052'
+#define COMPRESS2c '\126'
+#define ZMPc  '\135'
+
+/* The longest subnegotiation we care about */
+#define SB_LEN 64
+
+#define TERMINAL_TYPE "mcts-bench"
+
+/* How many commands the flooder keeps on their way to the server */
+#define FLOOD_DEPTH 64
+
+typedef enum conn_state {
+    cs_connecting,	/* Waiting for connect() to finish */
+    cs_negotiating,	/* Waiting for the server to turn on EOR */
+    cs_running,		/* Sending commands */
+    cs_closed
+} conn_state;
+
+typedef enum telnet_state {
+    ts_normal,
+    ts_iac,
+    ts_will,
+    ts_wont,
+    ts_do,
+    ts_dont,
+    ts_sb,
+    ts_sbiac
+} telnet_state;
+
+typedef struct conn {
+    int fd;
+    conn_state state;
+    telnet_state t_state;
+    unsigned char sb[SB_LEN];
+    int sb_len;
+    uint64_t connect_start;
+    uint64_t cmd_start;		/* When the outstanding command was (meant to be) sent */
+    uint64_t next_send;		/* When the next command should be sent */
+    int script_pos;
+    bool skip_eor;		/* The next prompt is the zmpecho command's */
+    bool flooder;		/* Sends flood_cmd without waiting, see -F */
+    int outstanding;		/* The flooder's commands without a prompt */
+    const char *typing;		/* -k: the command that is being typed */
+    size_t typed;		/* Its bytes that are sent */
+    size_t echo_wait;		/* The echoed bytes still to come */
+    uint64_t key_start;		/* When the last piece was sent */
+    bool echo_on;		/* -k: the server is asked to echo */
+    uint32_t last_text;		/* -k: the last three bytes of text */
+    char *outbuf;		/* Data that could not be sent yet */
+    size_t outlen;
+#if HAVE_ZLIB
+    z_stream *zs;
+#endif
+} conn;
+
+/* Settings */
+static const char *host = "127.0.0.1";
+static const char *port = "5445";
+static const char *unix_path;		/* -U, instead of host and port */
+static int n_conns = 10;
+static double rate;		/* Commands per second and connection, 0 = no pause */
+static double duration = 10;
+static bool use_mccp;
+static bool connect_rate;	/* -C, reconnect when the negotiation is done */
+static double zmp_rate;		/* -Z, mcts.echo messages per second and connection */
+static const char *flood_cmd;	/* -F, the flooder's command */
+static int keys;		/* -k, characters per piece, 0 = send whole lines */
+static int width = 80, height = 24;
+static char **script;
+static int script_len;
+
+static conn *conns;
+
+/* Results */
+static histogram connect_hist;
+static histogram rtt_hist;
+static histogram setup_hist;	/* From connect() to the end of the negotiation */
+static histogram zmp_hist;	/* From the server's timestamp to when it arrived */
+static histogram echo_hist;	/* From a typed piece to its echo */
+static uint64_t sessions;
+static uint64_t commands;
+static uint64_t bytes_in;	/* As received from the socket */
+static uint64_t bytes_in_plain;	/* After decompression */
+static uint64_t bytes_out;
+static uint64_t flood_commands;
+static uint64_t flood_bytes;
+static uint64_t echo_bytes;
+static uint64_t echo_reads;	/* The reads that got echo */
+static int failed;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+conn_close(conn *c)
+{
+    if(c->state == cs_closed) return;
+    close(c->fd);
+    c->state = cs_closed;
+#if HAVE_ZLIB
+    if(c->zs) {
+        inflateEnd(c->zs);
+        free(c->zs);
+        c->zs = NULL;
+    }
+#endif
+}
+
+static void
+conn_write(conn *c, const void *data, size_t len)
+{
+    if(c->state == cs_closed) return;
+    if(!c->outlen) {
+        ssize_t n = send(c->fd, data, len, 0);
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn_close(c);
+                failed++;
+                return;
+            }
+            n = 0;
+        }
+        bytes_out += n;
+        data = (const char *)data + n;
+        len -= n;
+        if(!len) return;
+    }
+    c->outbuf = realloc(c->outbuf, c->outlen + len);
+    memcpy(c->outbuf + c->outlen, data, len);
+    c->outlen += len;
+}
+
+static void
+conn_flush(conn *c)
+{
+    ssize_t n;
+    if(!c->outlen) return;
+    n = send(c->fd, c->outbuf, c->outlen, 0);
+    if(n < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn_close(c);
+            failed++;
+        }
+        return;
+    }
+    bytes_out += n;
+    memmove(c->outbuf, c->outbuf + n, c->outlen - n);
+    c->outlen -= n;
+}
+
+static void
+send_option(conn *c, char cmd, char option)
+{
+    char buff[3] = { IACc, cmd, option };
+    conn_write(c, buff, 3);
+}
+
+static void
+send_naws(conn *c)
+{
+    unsigned char buff[13];
+    int len = 0;
+    int values[2] = { width, height };
+    int i;
+
+    buff[len++] = IACc;
+    buff[len++] = SBc;
+    buff[len++] = NAWSc;
+    for(i = 0; i < 2; i++) {
+        unsigned char hi = values[i] >> 8, lo = values[i] & 255;
+        buff[len++] = hi;
+        if(hi == 255) buff[len++] = hi;
+        buff[len++] = lo;
+        if(lo == 255) buff[len++] = lo;
+    }
+    buff[len++] = IACc;
+    buff[len++] = SEc;
+    conn_write(c, buff, len);
+}
+
+/* The server offers to do something */
+static void
+handle_will(conn *c, char option)
+{
+    switch(option) {
+        case CHARSETc:
+        case EOR_OPTc:
+        case ZMPc:
+            send_option(c, DOc, option);
+            break;
+        case ECHOc:
+            if(!keys) send_option(c, DONTc, option);
+            break;		/* Else it is the answer to our DO */
+        case COMPRESS2c:
+            send_option(c, use_mccp ? DOc : DONTc, option);
+            break;
+        default:
+            send_option(c, DONTc, option);
+    }
+}
+
+/* The server asks us to do something */
+static void
+handle_do(conn *c, char option)
+{
+    switch(option) {
+        case NAWSc:
+            send_option(c, WILLc, option);
+            send_naws(c);
+            break;
+        case TTc:
+            send_option(c, WILLc, option);
+            break;
+        default:
+            send_option(c, WONTc, option);
+    }
+}
+
+/* Send a mcts.echo message back as it was, and see how old it is */
+static void
+echo_zmp(conn *c)
+{
+    unsigned char buff[2 * SB_LEN + 4];
+    const char *stamp;
+    uint64_t sent, now = now_ns();
+    int i, len = 0;
+
+    buff[len++] = IACc;
+    buff[len++] = SBc;
+    for(i = 0; i < c->sb_len; i++) {
+        if(c->sb[i] == (unsigned char)IACc) buff[len++] = IACc;
+        buff[len++] = c->sb[i];
+    }
+    buff[len++] = IACc;
+    buff[len++] = SEc;
+    conn_write(c, buff, len);
+
+    /* ZMP "mcts.echo" NUL seq NUL stamp NUL. The clocks are the same
+     * on one host only. */
+    if(c->sb_len < 2 || c->sb[c->sb_len - 1]) return;
+    stamp = (const char *)c->sb + 11;
+    stamp += strlen(stamp) + 1;
+    if(stamp >= (const char *)c->sb + c->sb_len) return;
+    sent = strtoull(stamp, NULL, 10);
+    hist_add(&zmp_hist, now > sent ? now - sent : 0);
+}
+
+/* Returns true if the rest of the stream is compressed */
+static bool
+handle_sb(conn *c)
+{
+    if(c->sb_len > 11 && c->sb[0] == (unsigned char)ZMPc &&
+       !memcmp(c->sb + 1, "mcts.echo", 10)) {
+        echo_zmp(c);
+        return false;
+    }
+    if(c->sb_len >= 2 && c->sb[0] == (unsigned char)TTc && c->sb[1] == 1) {
+        static const char reply[] = "\377\372\030\000" TERMINAL_TYPE "\377\360";
+        conn_write(c, reply, sizeof(reply) - 1);
+    }
+#if HAVE_ZLIB
+    if(c->sb_len >= 1 && c->sb[0] == (unsigned char)COMPRESS2c && use_mccp) {
+        c->zs = calloc(1, sizeof(z_stream));
+        if(inflateInit(c->zs) != Z_OK) {
+            fprintf(stderr, "inflateInit failed\n");
+            free(c->zs);
+            c->zs = NULL;
+            conn_close(c);
+            failed++;
+            return false;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
+
+/* Send the next piece of the command that is typed, or the end of
+ * the line when it is all echoed */
+static void
+type_next(conn *c, uint64_t now)
+{
+    size_t len = strlen(c->typing) - c->typed;
+
+    if(!len) {
+        conn_write(c, "\r\n", 2);
+        c->typing = NULL;
+        c->cmd_start = now;	/* The round trip is from the end of the line */
+        return;
+    }
+    if(len > (size_t)keys) len = keys;
+    conn_write(c, c->typing + c->typed, len);
+    c->typed += len;
+    c->echo_wait = len;
+    c->key_start = now;
+}
+
+static void handle_eor(conn *c, uint64_t now);
+
+/* A byte of text, not telnet, has been received */
+static void
+handle_text(conn *c, unsigned char ch, uint64_t now)
+{
+    if(c->echo_wait) {
+        echo_bytes++;
+        if(!--c->echo_wait) {
+            hist_add(&echo_hist, now - c->key_start);
+            type_next(c, now);
+        }
+        return;
+    }
+    if(!c->echo_on) return;
+    /* When the server echoes, its prompts have no IAC EOR */
+    c->last_text = ((c->last_text << 8) | ch) & 0xffffff;
+    if(c->last_text == (('\n' << 16) | ('>' << 8) | ' '))
+        handle_eor(c, now);
+}
+
+/* A prompt has been received */
+static void
+handle_eor(conn *c, uint64_t now)
+{
+    if(c->state == cs_negotiating) {
+        /* The first EOR is sent when the option is turned on. */
+        c->state = cs_running;
+        c->next_send = now;
+        if(zmp_rate > 0) {
+            char cmd[64];
+            int len = snprintf(cmd, sizeof(cmd), "zmpecho %g\r\n", zmp_rate);
+            conn_write(c, cmd, len);
+            c->skip_eor = true;
+        } else if(keys && !c->flooder) {
+            /* The empty line's prompt comes after the server's
+             * debug output about the option */
+            static const char echo_on[] = { IACc, DOc, ECHOc, '\r', '\n' };
+            conn_write(c, echo_on, sizeof(echo_on));
+            c->echo_on = true;
+            c->skip_eor = true;
+        }
+        return;
+    }
+    if(c->skip_eor) {
+        c->skip_eor = false;
+        return;
+    }
+    if(c->flooder) {
+        if(c->outstanding > 0) {
+            c->outstanding--;
+            flood_commands++;
+        }
+        return;
+    }
+    if(c->cmd_start) {
+        hist_add(&rtt_hist, now - c->cmd_start);
+        commands++;
+        c->cmd_start = 0;
+    }
+}
+
+/* Parse uncompressed telnet data. Returns the number of bytes that
+ * were used, which is less than len if compression was turned on. */
+static size_t
+parse_telnet(conn *c, const unsigned char *data, size_t len, uint64_t now)
+{
+    size_t i;
+    bytes_in_plain += len;
+    for(i = 0; i < len && c->state != cs_closed; i++) {
+        unsigned char ch = data[i];
+        switch(c->t_state) {
+            case ts_normal:
+                if(ch == (unsigned char)IACc) c->t_state = ts_iac;
+                else handle_text(c, ch, now);
+                break;
+            case ts_iac:
+                c->t_state = ts_normal;
+                switch(ch) {
+                    case (unsigned char)WILLc: c->t_state = ts_will; break;
+                    case (unsigned char)WONTc: c->t_state = ts_wont; break;
+                    case (unsigned char)DOc: c->t_state = ts_do; break;
+                    case (unsigned char)DONTc: c->t_state = ts_dont; break;
+                    case (unsigned char)SBc:
+                        c->t_state = ts_sb;
+                        c->sb_len = 0;
+                        break;
+                    case (unsigned char)EORc:
+                        handle_eor(c, now);
+                        break;
+                    case (unsigned char)IACc:
+                        handle_text(c, ch, now);
+                        break;
+                }
+                break;
+            case ts_will:
+                c->t_state = ts_normal;
+                handle_will(c, ch);
+                break;
+            case ts_do:
+                c->t_state = ts_normal;
+                handle_do(c, ch);
+                break;
+            case ts_wont:
+            case ts_dont:
+                c->t_state = ts_normal;
+                break;
+            case ts_sb:
+                if(ch == (unsigned char)IACc) {
+                    c->t_state = ts_sbiac;
+                } else if(c->sb_len < SB_LEN) {
+                    c->sb[c->sb_len++] = ch;
+                }
+                break;
+            case ts_sbiac:
+                if(ch == (unsigned char)SEc) {
+                    c->t_state = ts_normal;
+                    if(handle_sb(c)) {
+                        bytes_in_plain -= len - i - 1;
+                        return i + 1;
+                    }
+                } else {
+                    c->t_state = ts_sb;
+                    if(c->sb_len < SB_LEN) c->sb[c->sb_len++] = ch;
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+static void
+handle_input(conn *c, unsigned char *data, size_t len, uint64_t now)
+{
+    while(len > 0 && c->state != cs_closed) {
+#if HAVE_ZLIB
+        if(c->zs) {
+            unsigned char out[16384];
+            int ret;
+            c->zs->next_in = data;
+            c->zs->avail_in = len;
+            do {
+                c->zs->next_out = out;
+                c->zs->avail_out = sizeof(out);
+                ret = inflate(c->zs, Z_SYNC_FLUSH);
+                if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    fprintf(stderr, "inflate failed: %d\n", ret);
+                    conn_close(c);
+                    failed++;
+                    return;
+                }
+                parse_telnet(c, out, sizeof(out) - c->zs->avail_out, now);
+            } while(ret == Z_OK && c->zs && (c->zs->avail_in || !c->zs->avail_out));
+            if(!c->zs) return;
+            data = c->zs->next_in;
+            len = c->zs->avail_in;
+            if(ret == Z_STREAM_END) {
+                /* The server turned off compression */
+                inflateEnd(c->zs);
+                free(c->zs);
+                c->zs = NULL;
+                continue;
+            }
+            return;
+        }
+#endif
+        {
+            size_t used = parse_telnet(c, data, len, now);
+            data += used;
+            len -= used;
+        }
+    }
+}
+
+static void
+send_command(conn *c, uint64_t now)
+{
+    const char *cmd = script[c->script_pos];
+    size_t len = strlen(cmd);
+    char buff[1024];
+
+    if(len > sizeof(buff) - 2) len = sizeof(buff) - 2;
+    memcpy(buff, cmd, len);
+    buff[len++] = '\r';
+    buff[len++] = '\n';
+    if(++c->script_pos == script_len) c->script_pos = 0;
+
+    /* With a fixed rate, measure from when the command should have been
+     * sent, so a slow server can't hide its latency by delaying us. */
+    c->cmd_start = rate > 0 ? c->next_send : now;
+    if(rate > 0) {
+        c->next_send += (uint64_t)(1e9 / rate);
+        if(c->next_send < now) c->next_send = now;
+    }
+    if(keys) {
+        c->typing = cmd;
+        c->typed = 0;
+        type_next(c, now);
+        return;
+    }
+    conn_write(c, buff, len);
+}
+
+/* Keep FLOOD_DEPTH commands on their way */
+static void
+send_flood(conn *c)
+{
+    size_t len = strlen(flood_cmd);
+    char buff[1024];
+
+    if(len > sizeof(buff) - 2) len = sizeof(buff) - 2;
+    memcpy(buff, flood_cmd, len);
+    buff[len++] = '\r';
+    buff[len++] = '\n';
+    while(c->outstanding < FLOOD_DEPTH) {
+        conn_write(c, buff, len);
+        c->outstanding++;
+    }
+}
+
+static bool
+start_connect(conn *c, struct addrinfo *ai)
+{
+    c->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(c->fd < 0) {
+        perror("socket");
+        return false;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    if(connect_rate) {
+        /* Reset instead of TIME_WAIT, or we run out of local ports */
+        struct linger l = { 1, 0 };
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+    c->t_state = ts_normal;
+    c->skip_eor = false;
+    c->outstanding = 0;
+    c->typing = NULL;
+    c->echo_wait = 0;
+    c->echo_on = false;
+    c->last_text = 0;
+    c->outlen = 0;
+    c->cmd_start = 0;
+    c->connect_start = now_ns();
+    c->state = cs_connecting;
+    if(connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        hist_add(&connect_hist, now_ns() - c->connect_start);
+        c->state = cs_negotiating;
+    } else if(errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        c->state = cs_closed;
+        return false;
+    }
+    return true;
+}
+
+static bool
+load_script(const char *filename)
+{
+    char line[1024];
+    FILE *f = fopen(filename, "r");
+    if(!f) {
+        perror(filename);
+        return false;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if(!*line || *line == '#') continue;
+        script = realloc(script, (script_len + 1) * sizeof(char *));
+        script[script_len++] = strdup(line);
+    }
+    fclose(f);
+    return true;
+}
+
+static void
+print_latency(const char *name, const histogram *h)
+{
+    printf("%-16s n=%llu  p50=%.1fus  p99=%.1fus  p999=%.1fus  max=%.1fus\n",
+           name, (unsigned long long)h->count,
+           hist_percentile(h, 50) / 1e3,
+           hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3,
+           h->max / 1e3);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host      the server's host, default 127.0.0.1.\n"
+            "  -p port      the server's port, default 5445.\n"
+            "  -U path      connect to the server's unix socket instead.\n"
+            "  -n conns     the number of connections, default 10.\n"
+            "  -r rate      commands per second and connection,\n"
+            "               default 0 = send the next as soon as the prompt arrives.\n"
+            "  -d seconds   how long to run, default 10.\n"
+            "  -c command   a command to send, can be given more than once.\n"
+            "  -s file      read the commands from a file, one per line.\n"
+            "  -g WxH       the window size to report with NAWS, default 80x24.\n"
+            "  -C           measure connections per second: reconnect as soon as\n"
+            "               the option negotiation is done, send no commands.\n"
+            "  -Z rate      have the server send this many ZMP mcts.echo messages\n"
+            "               per second and connection, and echo them.\n"
+            "  -F command   open one more connection that sends this command\n"
+            "               over and over without waiting for the prompts.\n"
+            "  -k keys      type the commands, this many characters at a time,\n"
+            "               with the server echoing them.\n"
+#if HAVE_ZLIB
+            "  -z           accept MCCP (COMPRESS2).\n"
+#endif
+            , name);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct addrinfo hints, *res, unix_ai;
+    struct sockaddr_un unix_addr;
+    struct pollfd *pfds;
+    uint64_t start, end, now;
+    int opt, i, err, open_conns, n_total;
+
+    while((opt = getopt(argc, argv, "H:p:U:n:r:d:c:s:g:CZ:F:k:zh")) != -1) {
+        switch(opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'U': unix_path = optarg; break;
+            case 'n': n_conns = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'c':
+                script = realloc(script, (script_len + 1) * sizeof(char *));
+                script[script_len++] = optarg;
+                break;
+            case 's':
+                if(!load_script(optarg)) return 1;
+                break;
+            case 'g':
+                if(sscanf(optarg, "%dx%d", &width, &height) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'C': connect_rate = true; break;
+            case 'Z': zmp_rate = atof(optarg); break;
+            case 'F': flood_cmd = optarg; break;
+            case 'k': keys = atoi(optarg); break;
+#if HAVE_ZLIB
+            case 'z': use_mccp = true; break;
+#endif
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(n_conns < 1 || keys < 0 || optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(!script_len) {
+        static char *default_script[] = { "sendasis mcts-bench" };
+        script = default_script;
+        script_len = 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if(unix_path) {
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        snprintf(unix_addr.sun_path, sizeof(unix_addr.sun_path), "%s", unix_path);
+        memset(&unix_ai, 0, sizeof(unix_ai));
+        unix_ai.ai_family = AF_UNIX;
+        unix_ai.ai_socktype = SOCK_STREAM;
+        unix_ai.ai_addr = (struct sockaddr *)&unix_addr;
+        unix_ai.ai_addrlen = sizeof(unix_addr);
+        res = &unix_ai;
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if((err = getaddrinfo(host, port, &hints, &res))) {
+            fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+            return 1;
+        }
+    }
+
+    n_total = n_conns + (flood_cmd ? 1 : 0);
+    conns = calloc(n_total, sizeof(conn));
+    pfds = calloc(n_total, sizeof(struct pollfd));
+    for(i = 0; i < n_total; i++) {
+        conns[i].fd = -1;
+        conns[i].flooder = i == n_conns;
+        if(!start_connect(&conns[i], res)) failed++;
+        else conns[i].script_pos = i % script_len;
+    }
+
+    start = now_ns();
+    end = start + (uint64_t)(duration * 1e9);
+    while((now = now_ns()) < end) {
+        int timeout = (int)((end - now) / 1000000);
+        open_conns = 0;
+
+        /* Send the commands that are due */
+        for(i = 0; i < n_total; i++) {
+            conn *c = &conns[i];
+            if(c->state != cs_running || c->skip_eor)
+                continue;
+            if(c->flooder) {
+                send_flood(c);
+                continue;
+            }
+            if(!c->cmd_start && c->next_send <= now)
+                send_command(c, now);
+            if(!c->cmd_start && c->next_send > now) {
+                int t = (int)((c->next_send - now + 999999) / 1000000);
+                if(t < timeout) timeout = t;
+            }
+        }
+
+        for(i = 0; i < n_total; i++) {
+            conn *c = &conns[i];
+            pfds[i].fd = c->state == cs_closed ? -1 : c->fd;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+            if(c->state == cs_connecting || c->outlen)
+                pfds[i].events |= POLLOUT;
+            if(c->state != cs_closed) open_conns++;
+        }
+        if(!open_conns) break;
+
+        if(poll(pfds, n_total, timeout) <= 0)
+            continue;
+        now = now_ns();
+
+        for(i = 0; i < n_total; i++) {
+            conn *c = &conns[i];
+            if(!pfds[i].revents || c->state == cs_closed) continue;
+            if(c->state == cs_connecting) {
+                int so_error = 0;
+                socklen_t so_len = sizeof(so_error);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len);
+                if(so_error) {
+                    fprintf(stderr, "connect: %s\n", strerror(so_error));
+                    conn_close(c);
+                    failed++;
+                    continue;
+                }
+                hist_add(&connect_hist, now - c->connect_start);
+                c->state = cs_negotiating;
+            }
+            if(pfds[i].revents & (POLLIN|POLLHUP|POLLERR)) {
+                unsigned char buff[65536];
+                ssize_t n = recv(c->fd, buff, sizeof(buff), 0);
+                if(n > 0) {
+                    uint64_t echoed = echo_bytes;
+                    bytes_in += n;
+                    if(c->flooder) flood_bytes += n;
+                    handle_input(c, buff, n, now);
+                    if(echo_bytes != echoed) echo_reads++;
+                    if(connect_rate && c->state == cs_running) {
+                        conn_flush(c);
+                        hist_add(&setup_hist, now - c->connect_start);
+                        sessions++;
+                        conn_close(c);
+                        if(!start_connect(c, res)) failed++;
+                        continue;
+                    }
+                } else if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    fprintf(stderr, "connection %d was closed by the server\n", i);
+                    conn_close(c);
+                    failed++;
+                    continue;
+                }
+            }
+            if(pfds[i].revents & POLLOUT)
+                conn_flush(c);
+        }
+    }
+    now = now_ns();
+
+    for(i = 0; i < n_total; i++)
+        conn_close(&conns[i]);
+    if(!unix_path)
+        freeaddrinfo(res);
+
+    {
+        double secs = (now - start) / 1e9;
+        printf("connections:     %d (%d failed)\n", n_conns, failed);
+        print_latency("connect:", &connect_hist);
+        if(connect_rate) {
+            print_latency("negotiation:", &setup_hist);
+            printf("sessions:        %llu (%.1f/s)\n",
+                   (unsigned long long)sessions, sessions / secs);
+        }
+        print_latency("round trip:", &rtt_hist);
+        if(zmp_rate > 0)
+            print_latency("zmp delay:", &zmp_hist);
+        if(keys) {
+            print_latency("echo:", &echo_hist);
+            printf("echo reads:      %llu for %llu bytes (%.1f bytes per read)\n",
+                   (unsigned long long)echo_reads, (unsigned long long)echo_bytes,
+                   echo_reads ? (double)echo_bytes / echo_reads : 0.0);
+        }
+        printf("commands:        %llu (%.1f/s)\n",
+               (unsigned long long)commands, commands / secs);
+        if(flood_cmd)
+            printf("flooder:         %llu commands (%.1f/s), %llu bytes (%.2f MB/s)\n",
+                   (unsigned long long)flood_commands, flood_commands / secs,
+                   (unsigned long long)flood_bytes, flood_bytes / secs / 1e6);
+        printf("received:        %llu bytes (%.2f MB/s)",
+               (unsigned long long)bytes_in, bytes_in / secs / 1e6);
+        if(bytes_in_plain != bytes_in)
+            printf(", %llu bytes uncompressed",
+                   (unsigned long long)bytes_in_plain);
+        printf("\nsent:            %llu bytes (%.2f MB/s)\n",
+               (unsigned long long)bytes_out, bytes_out / secs / 1e6);
+    }
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,370 @@
+/*
+ * Mud Client Test Server. Copyright 2006, 2007, 2009 Sebastian Andersson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * mcts-replay - plays back a client session that was recorded with
+ * "mcts -r <file>" against a running server.
+ *
+ * The data the client sent is sent again, either with the recorded
+ * timing or as fast as possible, while everything the server sends
+ * is read and counted.
+ *
+ * Compile with:
+ *   gcc -g -Wall mcts-replay.c -o mcts-replay
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+#include "record.h"
+
+/* For how long must the server be silent before we think it is done? */
+#define IDLE_NS 1000000000ULL
+
+typedef struct packet {
+    uint64_t time;
+    uint32_t session;
+    uint32_t len;
+    int type;
+    const unsigned char *data;
+} packet;
+
+static packet *packets;
+static int n_packets;
+
+static uint64_t bytes_received;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read the whole file and split it into packets */
+static bool
+load_file(const char *filename)
+{
+    struct stat st;
+    unsigned char *buff, *p, *end;
+    int fd = open(filename, O_RDONLY);
+    int max_packets = 1024;
+
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        return false;
+    }
+    buff = malloc(st.st_size ? st.st_size : 1);
+    if(!buff || read(fd, buff, st.st_size) != st.st_size) {
+        perror(filename);
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    if(st.st_size < REC_MAGIC_LEN || memcmp(buff, REC_MAGIC, REC_MAGIC_LEN)) {
+        fprintf(stderr, "%s: not an mcts record file\n", filename);
+        return false;
+    }
+    packets = malloc(max_packets * sizeof(packet));
+    p = buff + REC_MAGIC_LEN;
+    end = buff + st.st_size;
+    while(p + REC_HEADER_LEN <= end) {
+        packet *pkt;
+        if(n_packets == max_packets) {
+            max_packets *= 2;
+            packets = realloc(packets, max_packets * sizeof(packet));
+        }
+        pkt = &packets[n_packets];
+        pkt->time = rec_get(p, 8);
+        pkt->session = rec_get(p + 8, 4);
+        pkt->len = rec_get(p + 12, 4);
+        pkt->type = p[16];
+        pkt->data = p + REC_HEADER_LEN;
+        if(pkt->data + pkt->len > end) {
+            fprintf(stderr, "%s: the last packet is truncated\n", filename);
+            break;
+        }
+        p = (unsigned char *)pkt->data + pkt->len;
+        n_packets++;
+    }
+    return true;
+}
+
+static void
+list_sessions(void)
+{
+    int i, j;
+    printf("session  address                  in bytes   out bytes   seconds\n");
+    for(i = 0; i < n_packets; i++) {
+        uint64_t in = 0, out = 0, end = packets[i].time;
+        char address[100] = "?";
+        uint32_t session = packets[i].session;
+
+        if(packets[i].type != REC_CONNECT) continue;
+        snprintf(address, sizeof(address), "%.*s",
+                 (int)packets[i].len, packets[i].data);
+        for(j = i; j < n_packets; j++) {
+            if(packets[j].session != session) continue;
+            if(packets[j].type == REC_IN) in += packets[j].len;
+            if(packets[j].type == REC_OUT) out += packets[j].len;
+            end = packets[j].time;
+            if(packets[j].type == REC_CLOSE) break;
+        }
+        printf("%7u  %-22s %10llu  %10llu  %8.2f\n",
+               session, address,
+               (unsigned long long)in, (unsigned long long)out,
+               (end - packets[i].time) / 1e9);
+    }
+}
+
+static int
+connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if((err = getaddrinfo(host, port, &hints, &res))) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    for(ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0) continue;
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd < 0) {
+        perror("connect");
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* Read everything the server has sent. Returns false if it closed
+ * the connection. */
+static bool
+drain(int fd)
+{
+    char buff[65536];
+    for(;;) {
+        ssize_t n = recv(fd, buff, sizeof(buff), 0);
+        if(n > 0) {
+            bytes_received += n;
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        return false;
+    }
+}
+
+/* Wait until "until", or until the server has sent something.
+ * Returns false if the connection was closed. */
+static bool
+wait_for(int fd, uint64_t until, short events)
+{
+    struct pollfd pfd;
+    uint64_t now = now_ns();
+    int timeout = until > now ? (int)((until - now + 999999) / 1000000) : 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN | events;
+    if(poll(&pfd, 1, timeout) > 0 && (pfd.revents & (POLLIN|POLLHUP|POLLERR))) {
+        return drain(fd);
+    }
+    return true;
+}
+
+static bool
+send_all(int fd, const unsigned char *data, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if(n > 0) {
+            data += n;
+            len -= n;
+        } else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if(!wait_for(fd, now_ns() + IDLE_NS, POLLOUT))
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int
+replay(const char *host, const char *port, uint32_t session, bool max_speed)
+{
+    uint64_t start = 0, first = 0, last_rx, sent = 0, recorded_out = 0;
+    int i, fd;
+    bool open = true, found = false;
+
+    fd = connect_to(host, port);
+    if(fd < 0) return 1;
+
+    start = now_ns();
+    for(i = 0; i < n_packets && open; i++) {
+        packet *pkt = &packets[i];
+        uint64_t due;
+
+        if(pkt->session != session) continue;
+        if(!found) {
+            first = pkt->time;
+            found = true;
+        }
+        if(pkt->type == REC_OUT) {
+            recorded_out += pkt->len;
+            continue;
+        }
+        if(pkt->type == REC_CLOSE) break;
+        if(pkt->type != REC_IN) continue;
+
+        due = max_speed ? 0 : start + (pkt->time - first);
+        while(open && now_ns() < due) {
+            open = wait_for(fd, due, 0);
+        }
+        if(open && !(open = drain(fd))) break;
+        if(!send_all(fd, pkt->data, pkt->len)) {
+            open = false;
+            break;
+        }
+        sent += pkt->len;
+    }
+    if(!found) {
+        fprintf(stderr, "There is no session %u in the file\n", session);
+        close(fd);
+        return 1;
+    }
+
+    /* Read the rest of the output, until the server is quiet. */
+    last_rx = now_ns();
+    while(open && now_ns() - last_rx < IDLE_NS) {
+        uint64_t before = bytes_received;
+        open = wait_for(fd, last_rx + IDLE_NS, 0);
+        if(bytes_received != before) last_rx = now_ns();
+    }
+    close(fd);
+
+    {
+        double secs = (last_rx - start) / 1e9;
+        printf("Replayed session %u %s\n", session,
+               max_speed ? "at max speed" : "at recorded speed");
+        printf("  sent:     %llu bytes\n", (unsigned long long)sent);
+        printf("  received: %llu bytes (%llu when recorded)\n",
+               (unsigned long long)bytes_received,
+               (unsigned long long)recorded_out);
+        printf("  time:     %.3f s", secs);
+        if(secs > 0)
+            printf(", %.1f kB/s received", bytes_received / secs / 1024);
+        printf("\n");
+    }
+    return 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <file>\n"
+            "  -l          list the sessions in the file.\n"
+            "  -s session  the session to replay, the first one by default.\n"
+            "  -m          send as fast as possible, not with the recorded timing.\n"
+            "  -H host     the server's host, default 127.0.0.1.\n"
+            "  -p port     the server's port, default 5445.\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    const char *port = "5445";
+    bool list = false, max_speed = false, have_session = false;
+    uint32_t session = 0;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "ls:mH:p:h")) != -1) {
+        switch(opt) {
+            case 'l':
+                list = true;
+                break;
+            case 's':
+                session = strtoul(optarg, NULL, 10);
+                have_session = true;
+                break;
+            case 'm':
+                max_speed = true;
+                break;
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if(!load_file(argv[optind]))
+        return 1;
+
+    if(list) {
+        list_sessions();
+        return 0;
+    }
+    if(!have_session) {
+        for(i = 0; i < n_packets; i++) {
+            if(packets[i].type == REC_CONNECT) {
+                session = packets[i].session;
+                have_session = true;
+                break;
+            }
+        }
+        if(!have_session) {
+            fprintf(stderr, "There are no sessions in the file\n");
+            return 1;
+        }
+    }
+    return replay(host, port, session, max_speed);
+}
@@ -35,17 +35,75 @@
  * There is a teststring for vt_tileset patch for NetHack.
  *
  * Compile with:
- *   gcc -g -Wall -DHAVE_ZLIB -lz mcts.c -o mcts
+ *   gcc -g -Wall -DHAVE_ZLIB mcts.c -o mcts -lz -lpthread
  *
  *   or, if the system doesn't have zlib:
  *
- *   gcc -g -Wall mcts.c -o mcts
+ *   gcc -g -Wall mcts.c -o mcts -lpthread
+ *
+ *   On Linux, add -DHAVE_EPOLL and -DHAVE_IO_URING for the faster
+ *   backends (io_uring needs Linux 5.19 or later to be used).
  *
  * CHANGES:
  *  v0.35 (unreleased).
  *  Fixed some bugs with the CHARSET implementation. Added so it can ACCEPT a charset as well.
  *  Added test_cc 10, to test Reverse Index. Probably not used much by muds.
  *  Added XXX, to test NetHack's vt_tileset patch's tile output.
+ *  Added "-r <file>" to record all traffic to a binary file, it can be
+ *  played back against the server with mcts-replay.
+ *  The testcc and testtext tests are now read from scenarios.txt, in
+ *  the current directory or next to the binary, new tests can be added
+ *  there without recompiling.
+ *  Added the "fragment" variable. The output is no longer sent in two
+ *  byte pieces unless it is set to 2.
+ *  Added the flood command, to benchmark how fast a client handles
+ *  text, colours, cursor movements, scrolling, UTF-8 and tiles.
+ *  The client sockets are non-blocking, large outputs (flood and the
+ *  scenarios) are sent as the client reads them.
+ *  Output to slow clients is paused at a high water mark instead of the
+ *  client being dropped at 16kB; cat and eall/promptall honour it too.
+ *  DROP_AT is now 1MB. Added the stats command.
+ *  All waiting connections are accepted at once, the listen queue is
+ *  longer (-b) and select takes FD_SETSIZE clients. The option
+ *  negotiation and the welcome text are sent with a single write.
+ *  Added the epoll and io_uring backends (-e). With io_uring, input
+ *  and output need no system calls of their own. The stats command
+ *  counts the system calls. epoll and io_uring take as many clients
+ *  as the open files limit allows, up to MAX_FD (64k).
+ *  ZMP messages are encoded in one buffer and sent with one write,
+ *  "flood <size> zmp" sends them mixed with text.
+ *  Added zmpecho, which measures how fast the client answers ZMP
+ *  messages, and timers for such things.
+ *  Lines can be up to 16k (-l) and subnegotiations up to 64k long, the
+ *  buffers for them grow when needed. Too long lines are reported.
+ *  All the lines a client sent at once are processed together, up to
+ *  32 of them before the next client, and their output is sent with
+ *  one write.
+ *  The clients take turns in a deficit round robin, so a client with
+ *  commands that write much can not slow down the others as much.
+ *  Output blocks and client variables are kept in pools for reuse, see
+ *  "stats".
+ *  colourshow and colourshow256 are made once and sent with one write.
+ *  Idle clients can be closed (-i, "set idle") and quiet ones sent IAC
+ *  NOP (-k) or TCP keepalives (-K). The timers are kept in a timer wheel.
+ *  Added tilestorm, which sends NetHack style map frames with
+ *  vt_tiledata tiles at a given frame rate.
+ *  The screen size from NAWS is kept. flood, tilestorm and "testtext 4"
+ *  are made for it, and what is made is kept for the next client with
+ *  the same size.
+ *  The echo of the input is sent once for all that was received at
+ *  once, not once per character.
+ *  TCP_NODELAY, TCP_QUICKACK, SO_SNDBUF, SO_RCVBUF and TCP_NOTSENT_LOWAT
+ *  can be set for the listener (-T) and per client with "set".
+ *  "make profile" builds mcts-profile, which times the hot paths. The
+ *  prof command and SIGUSR1 show the times.
+ *  The counters can be fetched over HTTP in the Prometheus format (-M).
+ *  The event loop's turns are timed, the ones longer than -S ms are
+ *  logged as stalls with the command that took the time.
+ *  The server listens on both 0.0.0.0 and ::, or on the addresses given
+ *  with -a, each with its own socket options.
+ *  Added unix socket listeners (-u), and mcts-bench -U to use them.
+ *  --stdio runs one session on stdin and stdout, without listening.
  *
  *  v0.34 (2009-01-03):
  *    Added "eall" and "promptall" commands, to test prompt handling in clients.
@@ -75,6 +133,9 @@
 
 #define VERSION "0.35"
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* For accept4() */
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -87,12 +148,26 @@
 #endif
 #include <time.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#if HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* <linux/fs.h> defines it as 1024, the output blocks are ours */
+#undef BLOCK_SIZE
+#endif
 #ifdef    NEED_SELECT_H
 #include <sys/select.h>
 #endif
@@ -104,6 +179,11 @@
 #endif
 #include <ctype.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "record.h"
+#include "histogram.h"
 #if HAVE_ZLIB
 #include <zlib.h>
 /* How much code can be compressed at most in one buffer?
@@ -112,23 +192,95 @@
 #define COMP_BUFF_LEN 4096
 #endif
 
-/* The maximum length of a received line from the client */
+/* The most lines that are processed for a client before the others
+ * get their turn. A client that pastes many commands gets them
+ * processed in batches of this many, with one write for the output. */
+#ifndef LINE_QUOTA
+#define LINE_QUOTA 32
+#endif
+
+/* The clients with lines take turns in a deficit round robin. Each turn
+ * a client gets TURN_QUANTUM more bytes, and every line it processes
+ * costs its length plus the output it queued. A client whose command
+ * wrote much more than that waits some turns while the others go on,
+ * and a client that has nothing more to do does not save up. */
+#ifndef TURN_QUANTUM
+#define TURN_QUANTUM (16 * 1024)
+#endif
+
+/* The line buffer's size when a client starts typing. It grows up to
+ * MAX_LINE bytes, which can be changed with -l; the rest of a longer
+ * line is ignored. */
 #ifndef LINELEN
 #define LINELEN 256
 #endif
+#ifndef MAX_LINE
+#define MAX_LINE (16 * 1024)
+#endif
+
+/* The longest subnegotiation that is accepted from a client */
+#ifndef MAX_SB
+#define MAX_SB (64 * 1024)
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/* The max length of a line in the scenario file */
+#define SCENARIO_LINE_LEN 8192
 
 /* One more than the max number of arguments to a ZMP command. */
 #define MAX_ZMP_ARGS 20
 
- /* Max number of simultanious connections to the server */
+ /* Max number of simultanious connections to the server, there is
+  * room for as many as the open files limit allows up to this.
+  * select() can't handle file descriptors above FD_SETSIZE. */
 #ifndef MAX_FD
-#define MAX_FD 10
+#define MAX_FD (64 * 1024)
+#endif
+
+/* The input buffer's size when a client connects. It grows if
+ * needed, but the server stops reading from a client that has sent
+ * INPUT_MAX bytes that have not been parsed yet. */
+#ifndef INPUT_BUFF_LEN
+#define INPUT_BUFF_LEN 4096
+#endif
+#ifndef INPUT_MAX
+#define INPUT_MAX (64 * 1024)
+#endif
+
+/* The default length of the queue of connections that are waiting to
+ * be accepted, can be changed with -b. */
+#ifndef LISTEN_BACKLOG
+#define LISTEN_BACKLOG 1024
 #endif
 
  /* How much output to a client can be buffered before the server gives
   * up and closes the connection that client? */
 #ifndef DROP_AT
-#define DROP_AT 16384
+#define DROP_AT (1024 * 1024)
+#endif
+
+/* Producers (flood, cat...) are paused when this much output is queued
+ * for the client, and broadcasts are kept back. They are resumed when
+ * the queue has shrunk to LOW_WATER. Both can be changed with "set". */
+#ifndef HIGH_WATER
+#define HIGH_WATER (64 * 1024)
+#endif
+#ifndef LOW_WATER
+#define LOW_WATER (16 * 1024)
+#endif
+
+/* A turn of the event loop that takes longer than this many ms is
+ * logged as a stall. Can be changed with -S. */
+#ifndef STALL_MS
+#define STALL_MS 100
+#endif
+
+/* A metrics request that is not done in this many seconds is closed */
+#ifndef HTTP_TIMEOUT
+#define HTTP_TIMEOUT 10
 #endif
 
 /* The size of the output buffers.
@@ -139,6 +291,18 @@
 #define BLOCK_SIZE 4096
 #endif
 
+/* How many freed output blocks, and how many of the small objects
+ * (client variables and their strings), are kept for reuse. */
+#ifndef POOL_KEEP_BLOCKS
+#define POOL_KEEP_BLOCKS 4096
+#endif
+#ifndef POOL_KEEP_SMALL
+#define POOL_KEEP_SMALL 1024
+#endif
+
+/* Strings this long, with the NUL, or shorter are taken from a pool */
+#define SHORT_STRING 32
+
 /*
  * Flags to server_write:
  *  SW_DONT_COMPRESS - do not compress this, even if we are
@@ -151,12 +315,32 @@
 #define SW_DO_FLUSH 32
 #define SW_FINISH 64
 
-/* The output queue entries */
+/* How much recorded traffic can be buffered while the recorder thread
+ * is busy writing the previous buffer to disk? */
+#ifndef RECORD_BUFF_LEN
+#define RECORD_BUFF_LEN (1024 * 1024)
+#endif
+
+/* The output queue entries.
+ * The bytes from text[start] up to text[end] have not been sent yet. */
 typedef struct output_queue {
     struct output_queue *next;
+    int start;
+    int end;
     char text[BLOCK_SIZE];
 } output_queue;
 
+/* How much may a producer write each time it is called? */
+#ifndef PRODUCER_CHUNK
+#define PRODUCER_CHUNK 8192
+#endif
+
+/* How much may a client's producer write before the other clients
+ * get their turn? */
+#ifndef PRODUCER_BUDGET
+#define PRODUCER_BUDGET (256 * 1024)
+#endif
+
 /* A state machine for parsing return and linefeed characters when
  * parsing the input.
  * crlf_cr - last character was a CR.
@@ -210,14 +394,86 @@ typedef struct key_value {
     char *value;
 } key_value;
 
+/* The kinds of timers a client can have, see run_timers() */
+enum { timer_zmp_echo, timer_idle, timer_keepalive, timer_tilestorm,
+       timer_count };
+
+/* A client's timer, it is in the timer wheel while it is set */
+typedef struct timer {
+    struct timer *next;
+    struct timer **prev;
+    uint64_t when;		/* When it goes off, 0 if not set */
+} timer;
+
+/* A client's zmpecho run, see handle_zmpecho() */
+typedef struct zmp_echo {
+    uint64_t interval;		/* ns between the pings */
+    uint64_t next;		/* When the next ping is sent */
+    uint32_t left;		/* Pings left to send */
+    bool forever;		/* Until "zmpecho stop" */
+    uint32_t sent;
+    uint32_t echoed;
+    histogram rtt;
+} zmp_echo;
+
+/* A client's tilestorm run, see handle_tilestorm() */
+typedef struct tilestorm {
+    struct rendering *r;	/* The frames */
+    int current;		/* The next frame to send */
+    size_t offset;		/* In data, when sent by the producer */
+    uint64_t interval;		/* ns between the frames, 0 = no pacing */
+    uint64_t next;		/* When the next frame is sent */
+    uint64_t start;
+    uint64_t end;
+    uint64_t sent;		/* Bytes */
+    uint32_t shown;		/* Frames */
+    uint32_t skipped;		/* Frames the client was too slow for */
+} tilestorm;
+
 /*
  * All the data saved per connected client.
  */
 typedef struct Client {
     struct sockaddr_storage address;
     socklen_t address_len;
+    char *inbuf;		/* Received data that is not parsed yet */
+    uint32_t inpos;		/* The first byte in inbuf that is not parsed */
+    uint32_t inlen;
+    uint32_t insize;
+    bool line_ready;		/* line has a line for server_read() */
+    bool want_write;		/* client_writable() should be called */
+    bool corked;		/* Queue all output until server_uncork() */
+    bool echoed;		/* Input was echoed, see parse_input() */
+    bool quickack;		/* Set TCP_QUICKACK again after each read */
+    uint8_t listener;		/* Where it connected, in listeners */
+    bool http;			/* A metrics request, see http_input() */
+    bool http_done;		/* Close it when the answer is sent */
+    bool stdio;			/* --stdio: reads stdin, writes to stdio_out */
+    bool input_done;		/* stdin is closed, end when all is written */
+    int deficit;		/* What its lines may still use, see TURN_QUANTUM */
+    uint32_t events;		/* epoll: the registered events */
+    int sending;		/* io_uring: the number of sends in flight */
+    bool receiving;		/* io_uring: a recv is armed */
     output_queue *writebuff;	/* Write buffer. Used for non-blocking IO */
-    char holdbuff[LINELEN];		/* The line the client is working on */
+    output_queue *writetail;	/* The last block in writebuff */
+    output_queue *deferred;	/* Broadcasts, waiting for writebuff to drain */
+    output_queue *deferred_tail;
+    uint32_t deferlen;
+    uint32_t high_water;	/* See HIGH_WATER, LOW_WATER and DROP_AT */
+    uint32_t low_water;
+    uint32_t drop_at;
+    uint32_t max_writelen;	/* The longest the output queue has been */
+    /* The client's input arena: inbuf above, the line the client is
+     * working on, and the subnegotiation that is being received.
+     * They grow when needed and shrink again when idle, see trim_input() */
+    char *line;
+    uint32_t line_size;
+    uint32_t line_len;		/* The length of the line for server_read() */
+    char *sb;
+    uint32_t sb_len;
+    uint32_t sb_size;
+    bool line_too_long;		/* The line didn't fit */
+    bool sb_too_long;		/* The subnegotiation didn't fit */
 #if HAVE_ZLIB
     z_stream *stream;
     Bytef *comp_buffer;
@@ -225,11 +481,11 @@ typedef struct Client {
     telnet_state t_state;
     crlf_state c_state;
     uint16_t mode;		/* misc. telnet modes. */
-    uint16_t curr;		/* Where the client is on the line */
+    uint32_t curr;		/* Where the client is on the line */
     uint16_t position;		/* The x position on the line */
-    uint16_t writelen;		/* The number of bytes in the output buffer */
-    uint16_t x_size, y_size;
-    uint16_t telnet_position;     /* for long options */
+    uint32_t writelen;		/* The number of bytes in the output buffer */
+    uint16_t x_size, y_size;	/* The screen size from NAWS, 0 if unknown */
+    uint16_t fragment;		/* If set, send at most this many bytes per send() */
 
     /* telnet options' states:
      * No extended states are supported (state # above 255).
@@ -239,9 +495,39 @@ typedef struct Client {
 
     key_value *variables;
     bool is_connected;
+    uint32_t session;		/* Unique number of the connection, for the recorder */
+
+    /* A producer generates large outputs (flood, scenarios...) a piece
+     * at a time, when the client has received the previous piece.
+     * It returns false when it is done. producer_data is free()d then. */
+    bool (*producer)(int clinr);
+    void *producer_data;
+    void (*producer_stop)(void *data);	/* Frees producer_data, if set */
+    bool paused;		/* The producer waits for LOW_WATER */
+
+    timer timers[timer_count];
+    zmp_echo *zmp_echo;
+    tilestorm *tilestorm;	/* A paced tilestorm run */
+    uint64_t last_input;	/* When it last sent something */
+    int idle_timeout;		/* Seconds until it is closed, 0 = never */
 } Clients;
 
 int server_write(int clientnr, const char *mesg, int mesglen, int flags);
+int server_writev(int clientnr, const struct iovec *iov, int iovcnt, int flags);
+int server_prompt(int clientnr, const char *prompt, int size);
+void server_uncork(int clientnr);
+int server_close(int clientnr);
+static bool flush_output(int clientnr);
+static void stop_producer(int clinr);
+static void run_producer(int clinr);
+static void release_deferred(int clientnr);
+static void zmp_echo_received(int clinr, const char *buff, int len);
+static void tilestorm_free(void *data);
+static void http_accept(int fd);
+static void metrics_accept(void);
+static void http_input(int clinr);
+static void want_write(int clinr, bool on);
+static void output_sent(int clientnr, ssize_t sent);
 void send_zmp(int fd, ...);
 
 /*
@@ -319,39 +605,573 @@ void send_zmp(int fd, ...);
 #define DONTc '\376'
 #define IACc '\377'
 
-/* select_fd_mask - what fds the select call should listen for,
-   read_fd_mask - what fds that need processing
-   select_write_fd_mask - what fds the select call should check if they
-                          are writeable
-   write_fd_mask - what fds that can be written to.
-   */
-static fd_set select_fd_mask,
-       read_fd_mask,
-       select_write_fd_mask,
-       write_fd_mask;
+/* Which way server_poll() waits for the sockets */
+typedef enum backend_type {
+    backend_select,
+    backend_epoll,
+    backend_io_uring
+} backend_type;
+
+static const char *backend_names[] = { "select", "epoll", "io_uring" };
+static backend_type backend = backend_select;
+
+/* Set when a telnet listener has connections for server_accept(),
+ * and when a metrics listener has requests */
+static bool accept_pending;
+static bool metrics_pending;
+
+/* The number of system calls the server has made for the clients,
+ * and the number of lines it has processed, for the stats command. */
+enum { sc_wait, sc_recv, sc_send, sc_accept, sc_ctl, sc_sockopt, sc_count };
+static const char *syscall_names[] = { "wait", "recv", "send", "accept", "ctl", "sockopt" };
+static uint64_t syscalls[sc_count];
+static uint64_t lines_processed;
+static histogram batch_size;	/* Lines processed per client and loop */
+
+static int listen_backlog = LISTEN_BACKLOG;
+
+/* The highest connected fd, and what it can shrink to: the listening
+ * sockets are below it */
+static int high_fd;
+static int min_high_fd;
+static int next_turn;		/* The client that is first in the next round */
+
+/* All the possibly connected client's data, max_fd of them: */
+static Clients *clients;
+static int max_fd;
+
+/* With --stdio the only client is stdin, its output goes here, and
+ * stdout is the log's */
+static int stdio_out = -1;
+/* Their flags before the server made them non-blocking, they are
+ * shared with the shell's terminal or pipe */
+static int stdin_flags, stdout_flags;
+
+/* Where the client's output is written */
+static inline int
+output_fd(int clinr)
+{
+    return clients[clinr].stdio ? stdio_out : clinr;
+}
+
 
-#ifdef __SVR4
-static fd_set exc_fd_mask;
-#endif /* __SVR4 */
+/*
+ * A buffer used within methods for creating debug data, this
+ * to avoid increasing the needed stack size.
+ */
+static char debug_buffer[1024];
+
+/* The limits new clients start with, "set" changes them per client */
+static uint32_t default_high_water = HIGH_WATER;
+static uint32_t default_low_water = LOW_WATER;
+static uint32_t default_drop_at = DROP_AT;
+static uint32_t max_line = MAX_LINE;
+static int default_idle_timeout;	/* -i, in seconds */
+static int keepalive_interval;		/* -k, in seconds */
+static int tcp_keepalive;		/* -K, in seconds */
+
+#ifndef TCP_QUICKACK
+#define TCP_QUICKACK 12
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
 
-/* The server's socket that is listening for connections */
-static int daemon_fd;
+/* The socket options that can be given for all listeners with -T, for
+ * one with -a, and per client with "set". -1 leaves the system's
+ * default. The accepted sockets inherit the listener's, except quickack
+ * which the client has to ask for again after every read. */
+enum { tcp_nodelay, tcp_quickack, tcp_sndbuf, tcp_rcvbuf, tcp_notsent_lowat, tcp_count };
+static const struct {
+    const char *name;
+    int level;
+    int option;
+} tcp_options[tcp_count] = {
+    { "nodelay", IPPROTO_TCP, TCP_NODELAY },
+    { "quickack", IPPROTO_TCP, TCP_QUICKACK },
+    { "sndbuf", SOL_SOCKET, SO_SNDBUF },
+    { "rcvbuf", SOL_SOCKET, SO_RCVBUF },
+    { "notsentlowat", IPPROTO_TCP, TCP_NOTSENT_LOWAT },
+};
+static int default_tcp[tcp_count] = { -1, -1, -1, -1, -1 };
+
+/* The sockets the server listens on: the telnet ones from -a, or
+ * 0.0.0.0 and :: on the port, and the metrics one from -M. */
+#ifndef MAX_LISTENERS
+#define MAX_LISTENERS 16
+#endif
 
-/* The server's TCP port that it is listening on */
-static int daemon_port;
+typedef enum listener_kind {
+    listen_telnet,
+    listen_metrics
+} listener_kind;
+
+typedef struct listener {
+    int fd;
+    listener_kind kind;
+    bool pending;		/* It has connections to accept */
+    char name[128];		/* The address and port or unix:<path> */
+    int tcp[tcp_count];		/* Its clients' options, see default_tcp */
+} listener;
+
+static listener listeners[MAX_LISTENERS];
+static int n_listeners;
+
+/* The output queue's length when the socket became writable */
+static histogram queue_depth;
+static uint64_t producer_pauses;
+static uint64_t deferred_bytes;
+static uint64_t dropped_clients;
+static uint64_t idle_reaped;
+static uint64_t keepalives_sent;
+static uint64_t echo_bytes;
+static uint64_t echo_flushes;		/* The input chunks that were echoed */
+static uint64_t accepts;
+static uint64_t bytes_in, bytes_out;
+static uint64_t mccp_in, mccp_out;	/* Of the MCCP streams that have ended */
+
+/* The event loop's turns: how long it was from a wakeup to the next
+ * wait, when the server could not see new input. A turn longer than
+ * stall_ns is a stall, it is logged with the slowest part of it. */
+static histogram loop_time;		/* In ns */
+static uint64_t loop_woke;		/* When the last wait returned */
+static uint64_t stall_ns = STALL_MS * 1000000ULL;
+static uint64_t stalls;
+static struct {
+    uint64_t ns;
+    int fd;			/* -1 if it was not for a client */
+    char what[40];
+} slowest;
+
+/* The round trips of the finished zmpecho runs */
+static histogram zmp_echo_rtt;
+
+/* The number that will be given to the next connected client */
+static uint32_t next_session;
+
+/* Set by the signal handler when the server should exit */
+static volatile sig_atomic_t stop_requested;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-/* The highest connected fd */
-static int high_fd;
+/* Part of the event loop's turn took ns, keep it if it is the slowest.
+ * what is a command or such, only its first word is kept. */
+static void
+loop_work(int fd, const char *what, uint64_t ns)
+{
+    int i;
+
+    if(ns <= slowest.ns)
+	return;
+    slowest.ns = ns;
+    slowest.fd = fd;
+    while(*what == ' ')
+	what++;
+    for(i = 0; what[i] && what[i] != ' ' && i < sizeof(slowest.what) - 1; i++)
+	slowest.what[i] = isprint((unsigned char)what[i]) ? what[i] : '?';
+    slowest.what[i] = 0;
+}
+
+/* Parses sizes like 100000, 64k, 10m or 1g */
+static uint64_t
+parse_size(const char *s)
+{
+    char *end;
+    uint64_t size = strtoull(s, &end, 10);
+    switch(tolower((unsigned char)*end)) {
+        case 'k': size <<= 10; break;
+        case 'm': size <<= 20; break;
+        case 'g': size <<= 30; break;
+    }
+    return size;
+}
 
-/* All the possibly connected client's data: */
-static Clients clients[MAX_FD];
+/* Returns the tcp_options index of name, or -1 */
+static int
+find_tcp_option(const char *name)
+{
+    int i;
+    for(i = 0; i < tcp_count; i++)
+	if(!strcmp(tcp_options[i].name, name))
+	    return i;
+    return -1;
+}
+
+/* Parses "<option>=<value>" into tcp, returns false if it is no option */
+static bool
+parse_tcp_option(const char *spec, int *tcp)
+{
+    const char *value = strchr(spec, '=');
+    char name[32];
+    int option;
+
+    snprintf(name, sizeof(name), "%.*s", value ? (int)(value - spec) : 0, spec);
+    option = find_tcp_option(name);
+    if(option < 0 || !value[1])
+	return false;
+    tcp[option] = (int)parse_size(value + 1);
+    return true;
+}
 
+/* Sets one of tcp_options on a socket, returns false with errno set
+ * if the system didn't take it */
+static bool
+set_tcp_option(int fd, int option, int value)
+{
+    syscalls[sc_sockopt]++;
+    return setsockopt(fd, tcp_options[option].level, tcp_options[option].option,
+                      &value, sizeof(value)) == 0;
+}
 
 /*
- * A buffer used within methods for creating debug data, this
- * to avoid increasing the needed stack size.
+ * Profiling. "make profile" builds mcts-profile with MCTS_PROFILE set,
+ * which times the hot paths into a histogram each. The times are CPU
+ * cycles where there is a time stamp counter, ns elsewhere, and include
+ * what the path calls. The "prof" command and SIGUSR1 show them.
  */
-static char debug_buffer[1024];
+#if MCTS_PROFILE
+enum { prof_parse_input, prof_process_char, prof_process_line,
+       prof_server_write, prof_deflate, prof_count };
+static const char *prof_names[] = {
+    "parse_input", "process_char", "process_line", "server_write", "deflate"
+};
+static histogram prof_hist[prof_count];
+static volatile sig_atomic_t prof_requested;	/* Set by SIGUSR1 */
+
+static inline uint64_t
+prof_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+#define PROF_START(name) uint64_t prof_##name##_start = prof_now()
+#define PROF_END(name) \
+    hist_add(&prof_hist[prof_##name], prof_now() - prof_##name##_start)
+#else
+#define PROF_START(name)
+#define PROF_END(name)
+#endif
+
+/*
+ * Timers. A client can have one timer of each kind, which is set to
+ * the time it goes off, or 0. The main loop calls run_timers() before
+ * it waits for the sockets.
+ *
+ * The timers are kept in a timer wheel of TIMER_SLOTS lists, one for
+ * each TIMER_TICK ns, so neither setting a timer nor running the ones
+ * that have gone off looks at the other clients. The timers that go off
+ * after this turn of the wheel wait in timer_later, which is gone
+ * through once per turn.
+ */
+#ifndef TIMER_TICK
+#define TIMER_TICK 1000000ULL
+#endif
+#define TIMER_SLOTS 4096	/* A power of two */
+
+static void zmp_echo_timer(int clinr, uint64_t now);
+static void idle_timer(int clinr, uint64_t now);
+static void keepalive_timer(int clinr, uint64_t now);
+static void tilestorm_timer(int clinr, uint64_t now);
+
+static void (*const timer_handlers[timer_count])(int clinr, uint64_t now) = {
+    zmp_echo_timer,
+    idle_timer,
+    keepalive_timer,
+    tilestorm_timer,
+};
+static timer *timer_wheel[TIMER_SLOTS];
+static uint64_t timer_slots_used[TIMER_SLOTS / 64];	/* A bit per slot */
+static timer *timer_later;
+static uint64_t timer_tick;	/* The tick that run_timers() is at */
+static int active_timers;
+
+static void
+timer_link(timer **list, timer *t)
+{
+    t->next = *list;
+    t->prev = list;
+    if(*list)
+	(*list)->prev = &t->next;
+    *list = t;
+}
+
+static void
+timer_unlink(timer *t)
+{
+    *t->prev = t->next;
+    if(t->next) {
+	t->next->prev = t->prev;
+    } else if(t->prev >= &timer_wheel[0] && t->prev < &timer_wheel[TIMER_SLOTS]) {
+	int slot = t->prev - timer_wheel;
+	timer_slots_used[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+}
+
+/* Put the timer in the slot of the tick it goes off at */
+static void
+timer_insert(timer *t)
+{
+    uint64_t tick = t->when / TIMER_TICK;
+    int slot;
+
+    if(tick < timer_tick)
+	tick = timer_tick;
+    if(tick >= timer_tick + TIMER_SLOTS) {
+	timer_link(&timer_later, t);
+	return;
+    }
+    slot = tick & (TIMER_SLOTS - 1);
+    timer_link(&timer_wheel[slot], t);
+    timer_slots_used[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static void
+set_timer(int clinr, int kind, uint64_t when)
+{
+    timer *t = &clients[clinr].timers[kind];
+
+    if(t->when) {
+	timer_unlink(t);
+	active_timers--;
+    }
+    t->when = when;
+    if(when) {
+	if(!active_timers++)
+	    timer_tick = now_ns() / TIMER_TICK;
+	timer_insert(t);
+    }
+}
+
+/* Move the slot's timers that have gone off to the due list */
+static void
+take_due_timers(int slot, uint64_t now, timer **due)
+{
+    timer *t = timer_wheel[slot], *next;
+
+    for(; t; t = next) {
+	next = t->next;
+	if(t->when <= now) {
+	    timer_unlink(t);
+	    timer_link(due, t);
+	}
+    }
+}
+
+/* How many ticks until the next slot with timers, or -1 */
+static int
+next_timer_slot(void)
+{
+    int from = timer_tick & (TIMER_SLOTS - 1);
+    int i, w = from / 64;
+    uint64_t bits = timer_slots_used[w] & (~0ULL << (from % 64));
+
+    for(i = 0; i <= TIMER_SLOTS / 64; i++) {
+	if(bits)
+	    return (w * 64 + __builtin_ctzll(bits) - from) & (TIMER_SLOTS - 1);
+	w = (w + 1) % (TIMER_SLOTS / 64);
+	bits = timer_slots_used[w];
+    }
+    return -1;
+}
+
+/* Call the handlers of the timers that have gone off.
+ * Returns the number of milliseconds until the next one, or -1. */
+static int
+run_timers(void)
+{
+    uint64_t now, now_tick, wait;
+    timer *due = NULL;
+    int next;
+
+    if(!active_timers)
+	return -1;
+    now = now_ns();
+    now_tick = now / TIMER_TICK;
+    for(;;) {
+	int slot = timer_tick & (TIMER_SLOTS - 1);
+	if(timer_slots_used[slot / 64] & (1ULL << (slot % 64)))
+	    take_due_timers(slot, now, &due);
+	if(timer_tick >= now_tick)
+	    break;
+	if(!(++timer_tick & (TIMER_SLOTS - 1)) && timer_later) {
+	    /* A new turn, take in the timers that go off in it */
+	    timer *later = timer_later;
+	    later->prev = &later;
+	    timer_later = NULL;
+	    while(later) {
+		timer *t = later;
+		timer_unlink(t);
+		timer_insert(t);
+	    }
+	}
+    }
+    /* The handlers are called last, so the timers they set are not
+     * missed by the loop above */
+    while(due) {
+	timer *t = due;
+	int clinr = ((char *)t - (char *)clients) / sizeof(clients[0]);
+	timer_unlink(t);
+	t->when = 0;
+	active_timers--;
+	timer_handlers[t - clients[clinr].timers](clinr, now);
+    }
+    if(!active_timers)
+	return -1;
+    next = next_timer_slot();
+    wait = TIMER_SLOTS - (timer_tick & (TIMER_SLOTS - 1));
+    if(next >= 0 && next < wait)
+	wait = next;
+    wait = (timer_tick + wait) * TIMER_TICK;
+    return wait <= now ? 1 : (wait - now + 999999) / 1000000;
+}
+
+/*
+ * Session recording.
+ *
+ * When the server is started with "-r <file>", all data received from
+ * and sent to the clients is appended to that file (see record.h for
+ * the format). The event loop only copies the data into record_buff,
+ * the recorder thread swaps buffers and writes the full one to the disk,
+ * so the clients never have to wait for the disk. If the thread can't
+ * keep up, packets are dropped and counted in record_dropped.
+ */
+static int record_fd = -1;
+static pthread_t record_thread;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static unsigned char *record_buff;	/* Filled by the event loop */
+static unsigned char *record_spare;	/* Owned by the recorder thread */
+static size_t record_len;
+static bool record_stopping;
+static unsigned long record_dropped;
+
+static void
+record_write_all(const unsigned char *buff, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = write(record_fd, buff, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            perror("record");
+            return;
+        }
+        buff += n;
+        len -= n;
+    }
+}
+
+static void *
+record_writer(void *arg)
+{
+    pthread_mutex_lock(&record_lock);
+    for(;;) {
+        unsigned char *buff;
+        size_t len;
+        struct timespec ts;
+
+        /* Wake up when the buffer is half full, or every 100ms */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if(ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while(record_len < RECORD_BUFF_LEN / 2 && !record_stopping) {
+            if(pthread_cond_timedwait(&record_cond, &record_lock, &ts) == ETIMEDOUT)
+                break;
+        }
+        if(!record_len) {
+            if(record_stopping) break;
+            continue;
+        }
+        buff = record_buff;
+        len = record_len;
+        record_buff = record_spare;
+        record_len = 0;
+        pthread_mutex_unlock(&record_lock);
+
+        record_write_all(buff, len);
+
+        pthread_mutex_lock(&record_lock);
+        record_spare = buff;
+    }
+    pthread_mutex_unlock(&record_lock);
+    return NULL;
+}
+
+static bool
+record_start(const char *filename)
+{
+    record_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+    if(record_fd < 0) {
+        perror(filename);
+        return false;
+    }
+    record_buff = malloc(RECORD_BUFF_LEN);
+    record_spare = malloc(RECORD_BUFF_LEN);
+    if(!record_buff || !record_spare) {
+        fprintf(stderr, "Failed to allocate the record buffers\n");
+        close(record_fd);
+        record_fd = -1;
+        return false;
+    }
+    record_write_all((const unsigned char *)REC_MAGIC, REC_MAGIC_LEN);
+    if(pthread_create(&record_thread, NULL, record_writer, NULL)) {
+        fprintf(stderr, "Failed to start the recorder thread\n");
+        close(record_fd);
+        record_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void
+record_stop(void)
+{
+    if(record_fd < 0) return;
+    pthread_mutex_lock(&record_lock);
+    record_stopping = true;
+    pthread_cond_signal(&record_cond);
+    pthread_mutex_unlock(&record_lock);
+    pthread_join(record_thread, NULL);
+    close(record_fd);
+    record_fd = -1;
+    if(record_dropped)
+        fprintf(stderr, "The recorder dropped %lu packets\n", record_dropped);
+}
+
+/* Add a packet to the record file, if recording is turned on */
+static void
+record_packet(int clinr, int type, const void *data, size_t len)
+{
+    uint64_t now;
+    if(record_fd < 0 || clients[clinr].http) return;
+
+    now = now_ns();
+    pthread_mutex_lock(&record_lock);
+    if(record_len + REC_HEADER_LEN + len > RECORD_BUFF_LEN) {
+        record_dropped++;
+    } else {
+        unsigned char *p = record_buff + record_len;
+        rec_put_header(p, now, clients[clinr].session, len, type);
+        if(len)
+            memcpy(p + REC_HEADER_LEN, data, len);
+        record_len += REC_HEADER_LEN + len;
+        if(record_len >= RECORD_BUFF_LEN / 2)
+            pthread_cond_signal(&record_cond);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
 
 
 static const char *
@@ -374,7 +1194,7 @@ simple_write(int fd, const char *str)
     return server_write(fd, str, strlen(str), 0);
 }
 
-static void process_line(int fd, char *line);
+static void process_line(int fd, char *line, int len);
 
 /*
  * Should we send TELNET debug information to the client?
@@ -399,59 +1219,228 @@ mputs(int fd, const char *str)
     return 0;
 }
 
-int
-server_init(int port)
-    /** Arguments:
-     *     port to listen to. If port = 0, pick one at random.
-     * Returns: <= 0 if error, daemon_port if okay. */
+/*
+ * Returns a socket bound to "<address>[:<port>]" from spec, or -1 after
+ * a message. address is changed.
+ */
+static int
+inet_socket(const char *spec, char *address, int port)
 {
-    struct sockaddr_in socket_addr;
-    memset(&socket_addr, 0, sizeof(socket_addr));
-
-    daemon_fd = socket(PF_INET, SOCK_STREAM, 0);
-
-    if(daemon_fd < 0)
-        return 0;
+    struct addrinfo hints, *ai;
+    char service[16], *colon;
+    int fd, err, on = 1;
+
+    snprintf(service, sizeof(service), "%d", port);
+    if(*address == '[') {
+        char *end = strchr(++address, ']');
+        if(!end || (end[1] && end[1] != ':')) {
+            fprintf(stderr, "%s: a ] is missing\n", spec);
+            return -1;
+        }
+        *end = 0;
+        if(end[1])
+            snprintf(service, sizeof(service), "%s", end + 2);
+    } else if((colon = strchr(address, ':')) && !strchr(colon + 1, ':')) {
+        /* Only IPv6 addresses have more than one colon */
+        *colon = 0;
+        snprintf(service, sizeof(service), "%s", colon + 1);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    if((err = getaddrinfo(*address ? address : "0.0.0.0", service, &hints, &ai))) {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(err));
+        return -1;
+    }
 
-#ifndef NO_REUSEADDR
-    int on = 1;
-    if(setsockopt(daemon_fd, SOL_SOCKET, SO_REUSEADDR,
-                (char *) &on, sizeof(on)) < 0) {
-        /* SO_REUSEADDR makes the socket able to "steal" port numbers */
-        close(daemon_fd);
-        return 0;
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd < 0) {
+        perror(spec);
+        freeaddrinfo(ai);
+        return -1;
     }
+#ifndef NO_REUSEADDR
+    /* SO_REUSEADDR makes the socket able to "steal" port numbers */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on));
 #endif				/* !NO_REUSEADDR */
-
+#ifdef IPV6_V6ONLY
+    /* So :: and 0.0.0.0 can both be listened on */
+    if(ai->ai_family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+#endif
 #ifdef __SVR4
     on = 0;
-    if(setsockopt(daemon_fd, SOL_SOCKET, SO_OOBINLINE,
-                (char *) &on, sizeof(on)) < 0) {
-        perror("setsockopt");
-        close(daemon_fd);
-        return 0;
-    }
+    setsockopt(fd, SOL_SOCKET, SO_OOBINLINE, (char *) &on, sizeof(on));
 #endif				/* __SVR4 */
 
-    socket_addr.sin_family = AF_INET;
-    socket_addr.sin_port = htons(port);
-    socket_addr.sin_addr.s_addr = INADDR_ANY;
+    err = bind(fd, ai->ai_addr, ai->ai_addrlen);
+    freeaddrinfo(ai);
+    if(err < 0) {
+        perror(spec);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    if(bind(daemon_fd, (struct sockaddr *) &socket_addr, sizeof(socket_addr)) < 0) {
-        /* Bind the socket to an adress in the inet family */
-        close(daemon_fd);
-        return 0;
+/* Returns a socket bound to the path, or -1 after a message */
+static int
+unix_socket(const char *spec, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(!*path || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: the path must be 1 to %d characters long\n", spec,
+                (int)sizeof(addr.sun_path) - 1);
+        return -1;
     }
-    if(listen(daemon_fd, 5) < 0) {
-        /* make it listen to connecting clients */
-        close(daemon_fd);
-        return 0;
+    strcpy(addr.sun_path, path);
+    /* A socket that is left from an earlier run is in the way */
+    if(!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(spec);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Open a listener on spec: "[<address>][:<port>][,<option>=<value>]..."
+ * or "unix:<path>[,<option>=<value>]...".
+ * The port is port if it is not given, an IPv6 address with a port is
+ * written in brackets and the options are the ones of -T.
+ * Returns false, after a message, if it can't be done.
+ */
+static bool
+listener_open(const char *spec, int port, listener_kind kind)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char buff[160], host[64], serv[16];
+    char *address = buff, *options;
+    listener *l = &listeners[n_listeners];
+    int fd, i;
+
+    if(n_listeners == MAX_LISTENERS) {
+        fprintf(stderr, "%s: there can be at most %d listeners\n", spec, MAX_LISTENERS);
+        return false;
+    }
+    memcpy(l->tcp, default_tcp, sizeof(l->tcp));
+    snprintf(buff, sizeof(buff), "%s", spec);
+    if((options = strchr(buff, ',')))
+        *options++ = 0;
+    while(options) {
+        char *next = strchr(options, ',');
+        if(next)
+            *next++ = 0;
+        if(!parse_tcp_option(options, l->tcp)) {
+            fprintf(stderr, "%s: unknown option %s\n", spec, options);
+            return false;
+        }
+        options = next;
+    }
+    if(!strncmp(address, "unix:", 5)) {
+        fd = unix_socket(spec, address + 5);
+        /* Only the buffer sizes are not TCP's */
+        for(i = 0; i < tcp_count; i++)
+            if(tcp_options[i].level != SOL_SOCKET)
+                l->tcp[i] = -1;
+    } else {
+        fd = inet_socket(spec, address, port);
+    }
+    if(fd < 0)
+        return false;
+    /* Set before listen(), so the window scale is made for rcvbuf */
+    for(i = 0; i < tcp_count; i++) {
+        if(l->tcp[i] < 0 || i == tcp_quickack) continue;
+        if(!set_tcp_option(fd, i, l->tcp[i])) {
+            perror(tcp_options[i].name);
+            close(fd);
+            return false;
+        }
+    }
+    /* Connections are accepted until there are no more */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(listen(fd, listen_backlog) < 0) {
+        perror(spec);
+        close(fd);
+        return false;
+    }
+
+    /* The name has the port that was picked, if it was 0 */
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    host[0] = serv[0] = 0;
+    getnameinfo((struct sockaddr *)&addr, len, host, sizeof(host), serv, sizeof(serv),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+    if(addr.ss_family == AF_UNIX)
+        snprintf(l->name, sizeof(l->name), "unix:%.*s", (int)sizeof(l->name) - 6,
+                 ((struct sockaddr_un *)&addr)->sun_path);
+    else
+        snprintf(l->name, sizeof(l->name), addr.ss_family == AF_INET6 ? "[%s]:%s" : "%s:%s",
+                 host, serv);
+    l->fd = fd;
+    l->kind = kind;
+    l->pending = false;
+    n_listeners++;
+    if(fd >= high_fd)
+        high_fd = min_high_fd = fd + 1;
+    return true;
+}
+
+/* The listener has connections or requests to accept */
+static void
+listener_ready(listener *l)
+{
+    l->pending = true;
+    if(l->kind == listen_metrics)
+        metrics_pending = true;
+    else
+        accept_pending = true;
+}
+
+/* Returns the first listener of the kind that has something to accept */
+static listener *
+pending_listener(listener_kind kind)
+{
+    int i;
+    for(i = 0; i < n_listeners; i++)
+        if(listeners[i].pending && listeners[i].kind == kind)
+            return &listeners[i];
+    return NULL;
+}
+
+/* Writes the client's address, for the log, to buffer */
+static void
+client_address(int fd, char *buffer, size_t size)
+{
+    buffer[0] = 0;
+    if(clients[fd].stdio) {
+        snprintf(buffer, size, "stdio");
+        return;
+    }
+    if(clients[fd].address.ss_family == AF_UNIX) {
+        /* Its peer has no name, the socket it came through has */
+        snprintf(buffer, size, "%s", listeners[clients[fd].listener].name);
+        return;
     }
-    FD_ZERO(&select_fd_mask);
-    FD_SET(daemon_fd, &select_fd_mask);
-    high_fd = daemon_fd + 1;
-    daemon_port = ntohs(socket_addr.sin_port);
-    return daemon_port;
+#ifdef NI_NUMERICHOST
+    getnameinfo((const struct sockaddr *)&clients[fd].address,
+                clients[fd].address_len,
+                buffer, size,
+                NULL, 0,
+                NI_NUMERICHOST);
+#else
+    snprintf(buffer, size, "unknown");
+#endif
 }
 
 static const char *
@@ -940,7 +1929,7 @@ process_zmp(int clinr, char *buff, int len)
         return;
     }else if(!strcmp(buff, "zpm.input")) {
         simple_write(clinr, "\r\n");
-        process_line(clinr, s);
+        process_line(clinr, s, strlen(s));
         return;
 #endif
     }
@@ -1237,10 +2226,15 @@ is_ok_charset(const char *buff, int len)
 static int
 process_telnet_sb_option(int clinr)
 {
-    char *buff = &clients[clinr].holdbuff[clients[clinr].curr];
-    int len = clients[clinr].telnet_position - clients[clinr].curr;
+    char *buff = clients[clinr].sb;
+    int len = clients[clinr].sb_len;
     int pos = 0;
     int i;
+    if(buff[0] == ZMPc && len > 10 && !memcmp(buff + 1, "mcts.echo", 10)) {
+	/* Echoes come too fast for the debug text */
+	zmp_echo_received(clinr, buff + 1, len - 1);
+	return 0;
+    }
     if(should_send_debug(clinr)) {
 	sprintf(debug_buffer, "RCVD IAC SB %s ", get_telnet_option(buff[0]));
 	simple_write(clinr, debug_buffer);
@@ -1400,6 +2394,8 @@ process_telnet_sb_option(int clinr)
                     x_size,
                     y_size);
             mputs(clinr, debug_buffer);
+            clients[clinr].x_size = x_size;
+            clients[clinr].y_size = y_size;
             break;
         case ZMPc:
             process_zmp(clinr, buff+1, len-1);
@@ -1419,21 +2415,150 @@ should_echo(int clinr) {
            !(clients[clinr].mode & SM_INVISIBLE);
 }
 
-static bool
-store_char(int clinr, unsigned char c)
+/*
+ * Pools for the objects that are allocated and freed all the time: the
+ * output blocks, and the client variables and their strings. A freed
+ * object is put on its pool's free list and the next one is taken from
+ * there, so a queue that fills and drains does not call malloc().
+ * Only POOL_KEEP_* objects are kept, the rest are given back to malloc.
+ * Only the main thread uses them.
+ */
+typedef struct pool {
+    const char *name;
+    size_t size;		/* Of its objects */
+    int keep;			/* The most free objects to keep */
+    void *free_list;
+    int n_free;
+    int in_use;
+    int peak;			/* The most that were in use at once */
+    uint64_t hits;		/* Taken from the free list */
+    uint64_t misses;		/* malloc()ed */
+} pool;
+
+static pool block_pool = { "output blocks", sizeof(output_queue), POOL_KEEP_BLOCKS };
+static pool var_pool = { "variables", sizeof(key_value), POOL_KEEP_SMALL };
+static pool string_pool = { "strings", SHORT_STRING, POOL_KEEP_SMALL };
+static pool *pools[] = { &block_pool, &var_pool, &string_pool };
+
+static void *
+pool_get(pool *p)
 {
-    // ignore control chars, they should have been
-    // parsed already if we wanted them.
-    if(c < ' ') return true;
-    if(c >= (unsigned char) '\200' &&
-            c <= (unsigned char) '\237') return true;
+    void *obj = p->free_list;
+
+    if(obj) {
+	p->free_list = *(void **)obj;
+	p->n_free--;
+	p->hits++;
+    } else {
+	if(!(obj = malloc(p->size)))
+	    return NULL;
+	p->misses++;
+    }
+    if(++p->in_use > p->peak)
+	p->peak = p->in_use;
+    return obj;
+}
+
+static void
+pool_put(pool *p, void *obj)
+{
+    if(!obj)
+	return;
+    p->in_use--;
+    if(p->n_free < p->keep) {
+	*(void **)obj = p->free_list;
+	p->free_list = obj;
+	p->n_free++;
+    } else {
+	free(obj);
+    }
+}
+
+/* strdup() that takes the short strings from string_pool */
+static char *
+pool_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = len <= SHORT_STRING ? pool_get(&string_pool) : malloc(len);
+
+    if(copy)
+	memcpy(copy, s, len);
+    return copy;
+}
+
+static void
+pool_strfree(char *s)
+{
+    if(s && strlen(s) + 1 <= SHORT_STRING)
+	pool_put(&string_pool, s);
+    else
+	free(s);
+}
+
+/* Make sure the region has room for want bytes.
+ * Returns false if there is no memory for it. */
+static bool
+grow_region(char **data, uint32_t *size, uint32_t want)
+{
+    uint32_t new_size = *size ? *size : LINELEN;
+    char *p;
+
+    if(want <= *size)
+        return true;
+    while(new_size < want)
+        new_size *= 2;
+    if(!(p = realloc(*data, new_size)))
+        return false;
+    *data = p;
+    *size = new_size;
+    return true;
+}
+
+static void
+store_sb_char(int clinr, char c)
+{
+    if(clients[clinr].sb_len >= MAX_SB ||
+       !grow_region(&clients[clinr].sb, &clients[clinr].sb_size,
+                    clients[clinr].sb_len + 2)) {
+        clients[clinr].sb_too_long = true;
+        return;
+    }
+    clients[clinr].sb[clients[clinr].sb_len++] = c;
+}
 
-    int line_left = LINELEN - clients[clinr].curr;
-    if(line_left <= 0) return false; // no more room.
+/* Echo the client's input. It is sent when all that was received
+ * at once is parsed, see parse_input(). */
+static void
+echo_write(int clinr, const char *buff, int len)
+{
+    server_write(clinr, buff, len, 0);
+    clients[clinr].echoed = true;
+    echo_bytes += len;
+}
+
+static bool
+store_char(int clinr, unsigned char c)
+{
+    // ignore control chars, they should have been
+    // parsed already if we wanted them.
+    if(c < ' ') return true;
+    if(c >= (unsigned char) '\200' &&
+            c <= (unsigned char) '\237') return true;
 
-    clients[clinr].holdbuff[clients[clinr].curr++] = c;
+    if(clients[clinr].curr >= max_line ||
+       !grow_region(&clients[clinr].line, &clients[clinr].line_size,
+                    clients[clinr].curr + 2)) {
+        if(!clients[clinr].line_too_long) {
+            clients[clinr].line_too_long = true;
+            sprintf(debug_buffer, "ERROR: The line is longer than %u bytes, "
+                    "the rest is ignored.\r\n", max_line);
+            simple_write(clinr, debug_buffer);
+        }
+        return false; // no more room.
+    }
+    clients[clinr].line[clients[clinr].curr++] = c;
     if(should_echo(clinr)) {
-        server_write(clinr, (const char*)&c, 1, SW_DO_FLUSH);
+        echo_write(clinr, (const char*)&c, 1);
     }
     return true;
 }
@@ -1445,18 +2570,44 @@ process_linefeed(int clinr)
        (clients[clinr].mode & (SM_INVISIBLE))) {
         server_write(clinr, "\r\n", 2, 0);
     }
-    clients[clinr].holdbuff[clients[clinr].curr] = 0;
+    if(!grow_region(&clients[clinr].line, &clients[clinr].line_size,
+                    clients[clinr].curr + 1)) {
+        clients[clinr].curr = 0;
+        return 0;
+    }
+    clients[clinr].line[clients[clinr].curr] = 0;
+    clients[clinr].line_len = clients[clinr].curr;
     clients[clinr].curr = 0;
+    clients[clinr].line_too_long = false;
     return 1;
     /* There might be more in the buffert but that
        has to wait until this line is read */
 }
 
+/* Erase n characters on the client's screen */
+static void
+echo_erase(int clinr, uint32_t n)
+{
+    char buff[3 * LINELEN];
+    uint32_t i;
+
+    if(!should_echo(clinr))
+        return;
+    for(i = 0; i < LINELEN && i < n; i++) {
+        buff[3 * i] = '\010';
+        buff[3 * i + 1] = ' ';
+        buff[3 * i + 2] = '\010';
+    }
+    while(n > 0) {
+        uint32_t size = n < LINELEN ? n : LINELEN;
+        echo_write(clinr, buff, 3 * size);
+        n -= size;
+    }
+}
+
 static int
 process_normal_char(int clinr, char c)
 {
-    unsigned int line_left = LINELEN - clients[clinr].curr;
-
     switch(clients[clinr].c_state) {
         case crlf_cr:
             if(c == '\0') { /* CR NUL */
@@ -1501,62 +2652,38 @@ process_normal_char(int clinr, char c)
                     return process_linefeed(clinr);
                 case '\022':	/* ^R Refresh */
                     if(should_echo(clinr)) {
-                        char buff[LINELEN + 2];
-                        buff[0] = '\r';
-                        buff[1] = '\n';
-                        strncpy(&buff[2], clients[clinr].holdbuff,
-                                LINELEN - line_left);
-                        server_write(clinr, buff, LINELEN - line_left + 2, SW_DO_FLUSH);
+                        struct iovec iov[2];
+                        iov[0].iov_base = "\r\n";
+                        iov[0].iov_len = 2;
+                        iov[1].iov_base = clients[clinr].line;
+                        iov[1].iov_len = clients[clinr].curr;
+                        server_writev(clinr, iov, 2, 0);
+                        clients[clinr].echoed = true;
                     }
                     break;
                 case '\025':	/* ^U Erase line */
-                    if(should_echo(clinr)) {
-                        char buff[3 * LINELEN + 1];
-                        unsigned int j = 0;
-                        while(j < (3 * (LINELEN - line_left))) {
-                            buff[j++] = '\010';
-                            buff[j++] = ' ';
-                            buff[j++] = '\010';
-                        }
-                        server_write(clinr, buff, j, SW_DO_FLUSH);
-                    }
+                    echo_erase(clinr, clients[clinr].curr);
                     clients[clinr].curr = 0;
                     break;
                 case '\027':	/* ^W Erase last word */
                     {
-                        char buff[3 * LINELEN];
-                        unsigned int j = 0;
-                        while((line_left < LINELEN) &&
-                                (clients[clinr].holdbuff[LINELEN - line_left - 1] == ' ')) {
-                            buff[j++] = '\010';
-                            buff[j++] = ' ';
-                            buff[j++] = '\010';
-                            line_left++;
-                        }
-                        while((line_left < LINELEN) &&
-                                (clients[clinr].holdbuff[LINELEN - line_left - 1] != ' ')) {
-                            buff[j++] = '\010';
-                            buff[j++] = ' ';
-                            buff[j++] = '\010';
-                            line_left++;
-                        }
-                        if(should_echo(clinr)) {
-                            if(j > 0)
-                                server_write(clinr, buff, j, SW_DO_FLUSH);
-                        }
-                        clients[clinr].curr = LINELEN - line_left;
+                        uint32_t curr = clients[clinr].curr;
+                        while(curr > 0 && clients[clinr].line[curr - 1] == ' ')
+                            curr--;
+                        while(curr > 0 && clients[clinr].line[curr - 1] != ' ')
+                            curr--;
+                        echo_erase(clinr, clients[clinr].curr - curr);
+                        clients[clinr].curr = curr;
                     }
                     break;
                 case '\010':	/* Backspace and delete */
                 case '\177':
-                    line_left += 1;
-                    if(line_left > LINELEN)
-                        line_left = LINELEN;
-                    else if(should_echo(clinr)) {
-                        char *buff = "\010 \010";
-                        server_write(clinr, buff, 3, SW_DO_FLUSH);
+                    if(clients[clinr].curr > 0) {
+                        clients[clinr].curr--;
+                        if(should_echo(clinr)) {
+                            echo_write(clinr, "\010 \010", 3);
+                        }
                     }
-                    clients[clinr].curr = LINELEN - line_left;
                     break;
                 default:
                     store_char(clinr, c);
@@ -1589,7 +2716,7 @@ process_char(int clinr, char c)
                     break;
                 case SBc:
                     clients[clinr].t_state = ts_sb;
-                    clients[clinr].telnet_position = clients[clinr].curr;
+                    clients[clinr].sb_len = 0;
                     break;
                 case '\371':	/* GA -> Go ahead */
                     mputs(clinr, "RCVD: IAC GA");
@@ -1665,10 +2792,20 @@ process_char(int clinr, char c)
         case ts_sbiac:
             if(c == IACc) {
                 clients[clinr].t_state = ts_sb;
-                clients[clinr].holdbuff[clients[clinr].telnet_position++] = c;
+                store_sb_char(clinr, c);
             } else if(c == SEc) {
                 // Done.
                 clients[clinr].t_state = ts_normal;
+                if(clients[clinr].sb_too_long) {
+                    clients[clinr].sb_too_long = false;
+                    sprintf(debug_buffer, "ERROR: A subnegotiation longer than %d "
+                            "bytes was ignored.\r\n", MAX_SB);
+                    simple_write(clinr, debug_buffer);
+                    return 0;
+                }
+                if(!clients[clinr].sb_len)
+                    return 0;
+                clients[clinr].sb[clients[clinr].sb_len] = 0;
                 return process_telnet_sb_option(clinr);
             } else {
                 // error.
@@ -1681,7 +2818,7 @@ process_char(int clinr, char c)
                 clients[clinr].t_state = ts_sbiac;
                 break;
             }
-            clients[clinr].holdbuff[clients[clinr].telnet_position++] = c;
+            store_sb_char(clinr, c);
             break;
         case ts_normal:
             if(c == IACc) {
@@ -1694,26 +2831,6 @@ process_char(int clinr, char c)
     return 0;
 }
 
-static int
-process_input(int clinr)
-{
-    char in_buff[LINELEN + 16];	/* A bit extra for prompts and some control chars */
-    unsigned int line_left = LINELEN - clients[clinr].curr;
-    int received = recv(clinr, in_buff, line_left, MSG_PEEK);
-    int i;
-    if(received <= 0) {
-        return -1;
-    }
-    for(i = 0; i < received; i++) {
-        if (process_char(clinr, in_buff[i])) {
-            recv(clinr, in_buff, i+1, 0); /* Eat what we have read */
-            return 1;
-        }
-    }
-    recv(clinr, in_buff, i, 0);	/* Eat what we have read */
-    return 0;
-}
-
 void
 server_invisible(int clinr)
 {
@@ -1732,1038 +2849,4039 @@ server_visible(int clinr)
     }
 }
 
-int
-server_poll(long sec, long usec)
+/*
+ * Input.
+ *
+ * Whatever the backend, received data is put in the client's input
+ * buffer, which is parsed a line at a time. When a line is done,
+ * line_ready is set and the rest of the buffer waits until the line
+ * has been processed.
+ */
+
+/* Make room for at least want more bytes in the client's input buffer */
+static char *
+input_space(int clinr, uint32_t want)
+{
+    if(clients[clinr].inpos == clients[clinr].inlen)
+	clients[clinr].inpos = clients[clinr].inlen = 0;
+    if(clients[clinr].insize - clients[clinr].inlen < want && clients[clinr].inpos) {
+	memmove(clients[clinr].inbuf, clients[clinr].inbuf + clients[clinr].inpos,
+	        clients[clinr].inlen - clients[clinr].inpos);
+	clients[clinr].inlen -= clients[clinr].inpos;
+	clients[clinr].inpos = 0;
+    }
+    if(clients[clinr].insize - clients[clinr].inlen < want) {
+	uint32_t size = clients[clinr].insize ? clients[clinr].insize : INPUT_BUFF_LEN;
+	while(size - clients[clinr].inlen < want)
+	    size *= 2;
+	clients[clinr].inbuf = realloc(clients[clinr].inbuf, size);
+	clients[clinr].insize = size;
+    }
+    return clients[clinr].inbuf + clients[clinr].inlen;
+}
+
+/* May more input be read from the client? */
+static bool
+input_room(int clinr)
+{
+    return !clients[clinr].input_done &&
+	clients[clinr].inlen - clients[clinr].inpos < INPUT_MAX;
+}
+
+/* recv() what the client has sent. Returns -1 if the connection is closed */
+static int
+read_input(int clinr)
+{
+    char *buff = input_space(clinr, 1024);
+    size_t room = clients[clinr].insize - clients[clinr].inlen;
+    int received;
+
+    syscalls[sc_recv]++;
+    if(clients[clinr].stdio)
+	received = read(clinr, buff, room);
+    else
+	received = recv(clinr, buff, room, 0);
+    if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+	return 0;
+    }
+    if(!received && clients[clinr].stdio) {
+	/* The output that is still coming is sent before it ends */
+	clients[clinr].input_done = true;
+	return 0;
+    }
+    if(received <= 0) {
+	return -1;
+    }
+    record_packet(clinr, REC_IN, buff, received);
+    bytes_in += received;
+    clients[clinr].inlen += received;
+    clients[clinr].last_input = now_ns();
+    if(clients[clinr].quickack)
+	set_tcp_option(clinr, tcp_quickack, 1);
+    return received;
+}
+
+/* Give back the memory of the input regions that have grown, when
+ * they are not used. Keeps a long line or a large subnegotiation
+ * from using memory for the rest of the session. */
+static void
+trim_input(int clinr)
+{
+    if(clients[clinr].insize > INPUT_BUFF_LEN &&
+       clients[clinr].inpos == clients[clinr].inlen) {
+	free(clients[clinr].inbuf);
+	clients[clinr].inbuf = NULL;
+	clients[clinr].inpos = clients[clinr].inlen = clients[clinr].insize = 0;
+    }
+    if(clients[clinr].line_size > LINELEN && !clients[clinr].curr &&
+       !clients[clinr].line_ready) {
+	free(clients[clinr].line);
+	clients[clinr].line = NULL;
+	clients[clinr].line_size = 0;
+    }
+    if(clients[clinr].sb_size > LINELEN && clients[clinr].t_state != ts_sb &&
+       clients[clinr].t_state != ts_sbiac) {
+	free(clients[clinr].sb);
+	clients[clinr].sb = NULL;
+	clients[clinr].sb_size = 0;
+    }
+}
+
+/*
+ * Parse the client's input until a line is done.
+ * The output is corked while the input is parsed, so the echo of all
+ * that the client sent at once (a paste, or fast typing) and the
+ * replies to its telnet options are sent with one write, and with
+ * MCCP one flush. If a line is done, the cork is left on for the
+ * line's output, the main loop sends it all.
+ * Returns true if there is a line for server_read()
+ */
+static bool
+parse_input(int clinr)
+{
+    bool corked = clients[clinr].corked;
+
+    if(clients[clinr].line_ready)
+	return true;
+    trim_input(clinr);
+    if(clients[clinr].inpos == clients[clinr].inlen)
+	return false;
+    if(clients[clinr].http) {
+	http_input(clinr);
+	return false;
+    }
+    PROF_START(parse_input);
+    clients[clinr].corked = true;
+    while(!clients[clinr].line_ready &&
+          clients[clinr].inpos < clients[clinr].inlen) {
+	PROF_START(process_char);
+	if(process_char(clinr, clients[clinr].inbuf[clients[clinr].inpos++]))
+	    clients[clinr].line_ready = true;
+	PROF_END(process_char);
+    }
+    if(clients[clinr].echoed) {
+	clients[clinr].echoed = false;
+	server_write(clinr, "", 0, SW_DO_FLUSH);	/* MCCP */
+	echo_flushes++;
+    }
+    if(!corked && !clients[clinr].line_ready)
+	server_uncork(clinr);
+    PROF_END(parse_input);
+    return clients[clinr].line_ready;
+}
+
+/* The client's queued output can be sent */
+static void
+client_writable(int clinr)
+{
+    if(clients[clinr].writelen && !flush_output(clinr)) {
+	clients[clinr].mode |= SM_QUITING;
+    } else if(clients[clinr].writelen <= clients[clinr].low_water) {
+	if(clients[clinr].deferred)
+	    release_deferred(clinr);
+	if(clients[clinr].producer)
+	    run_producer(clinr);
+	else if(!clients[clinr].writelen)
+	    want_write(clinr, false);
+    }
+}
+
+/*
+ * The select() backend. It works everywhere, but only with file
+ * descriptors below FD_SETSIZE, and it looks at all of them every time.
+ */
+static int
+select_wait(int timeout)
 {
-    int i, j, k;
+    fd_set read_fds, write_fds;
+#ifdef __SVR4
+    fd_set exc_fds;
+#endif
     struct timeval timer;
-    read_fd_mask = select_fd_mask;
-    write_fd_mask = select_write_fd_mask;
+    int i, j;
+
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    for(j = 0; j < n_listeners; j++)
+	FD_SET(listeners[j].fd, &read_fds);
+    for(j = 0; j < high_fd; j++) {
+	if(!clients[j].is_connected) continue;
+	if(input_room(j))
+	    FD_SET(j, &read_fds);
+	if(clients[j].want_write)
+	    FD_SET(output_fd(j), &write_fds);
+    }
 #ifdef __SVR4
-    exc_fd_mask = select_fd_mask;
-#endif				/* __SVR4 */
-    timer.tv_sec = sec;
-    timer.tv_usec = usec;
+    exc_fds = read_fds;
+#endif
+    timer.tv_sec = timeout / 1000;
+    timer.tv_usec = (timeout % 1000) * 1000;
+    syscalls[sc_wait]++;
 #ifdef __SVR4
-    i = select(high_fd, &read_fd_mask, &write_fd_mask, &exc_fd_mask,
-	       (sec || usec) ? &timer : (struct timeval *) NULL);
+    i = select(high_fd, &read_fds, &write_fds, &exc_fds,
+	       timeout >= 0 ? &timer : (struct timeval *) NULL);
 #else
-    i = select(high_fd, &read_fd_mask, &write_fd_mask, NULL,
-	       (sec || usec) ? &timer : (struct timeval *) NULL);
+    i = select(high_fd, &read_fds, &write_fds, NULL,
+	       timeout >= 0 ? &timer : (struct timeval *) NULL);
 #endif				/* __SVR4 */
+    loop_woke = now_ns();
     if(i <= 0)
 	return i;
-    for(j = 0; j < high_fd; j++)
-	if(j != daemon_fd) {
+    for(j = 0; j < n_listeners; j++)
+	if(FD_ISSET(listeners[j].fd, &read_fds))
+	    listener_ready(&listeners[j]);
+    for(j = 0; j < high_fd; j++) {
+	if(!clients[j].is_connected) continue;
 #ifdef __SVR4
-	    if(FD_ISSET(j, &exc_fd_mask)) {
-		char buff[1024];
-		k = recv(j, buff, sizeof(buff), MSG_OOB);
-		if(k < 0) {
-		    FD_SET(j, &read_fd_mask);
-		    FD_CLR(j, &exc_fd_mask);
-		} else {
-		    continue;
-		}
-	    }
+	if(FD_ISSET(j, &exc_fds)) {
+	    char buff[1024];
+	    if(recv(j, buff, sizeof(buff), MSG_OOB) < 0)
+		FD_SET(j, &read_fds);
+	    else
+		continue;
+	}
 #endif				/* __SVR4 */
+	if(FD_ISSET(j, &read_fds) && read_input(j) < 0)
+	    clients[j].mode |= SM_QUITING;
+	if(FD_ISSET(output_fd(j), &write_fds))
+	    client_writable(j);
+    }
+    return i;
+}
 
-            if(FD_ISSET(j, &read_fd_mask)) {
-                k = process_input(j);
-                if(!k) {	/* If the client is not done with the line ... */
-                    FD_CLR(j, &read_fd_mask);	/* ...remove it from the waiting */
-                    i--;
-                } else if(k < 0) {
-                    clients[j].mode |= SM_QUITING;
-                }
-            }
-            if(FD_ISSET(j, &write_fd_mask)) {
-                /* An users write had failed */
-                int retval;
-                if((retval = send(j, clients[j].writebuff->text,
-                                clients[j].writelen >
-                                BLOCK_SIZE ? BLOCK_SIZE : clients[j].
-                                writelen, 0)) > 0) {
-                    output_queue *next = clients[j].writebuff->next;
-                    free(clients[j].writebuff);
-
-                    if(next)
-                        clients[j].writelen -= BLOCK_SIZE;
-                    else {
-                        clients[j].writelen = 0;
-                        FD_CLR(j, &select_write_fd_mask);
-                    }
-                    clients[j].writebuff = next;
-                } else {
-                    clients[j].mode |= SM_QUITING;
-                }
-            }
-	    if(clients[j].mode & SM_QUITING)
-		FD_SET(j, &read_fd_mask);
+#if HAVE_EPOLL
+/*
+ * The epoll backend. Only the sockets that have something to say are
+ * looked at, and the registrations only change when a client starts
+ * or stops waiting to write.
+ */
+static int epoll_fd = -1;
+
+/* The clients' events have their fd in data.u64, the listeners' have
+ * this and their index. Only u64 is used, data.fd is not its low
+ * bits on big-endian machines. */
+#define EPOLL_LISTENER (1ULL << 32)
+
+static bool
+epoll_init(void)
+{
+    struct epoll_event ev;
+    int i;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+	return false;
+    for(i = 0; i < n_listeners; i++) {
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = EPOLL_LISTENER | i;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i].fd, &ev) < 0) {
+	    close(epoll_fd);
+	    epoll_fd = -1;
+	    return false;
 	}
-    return i;
+    }
+    return true;
 }
 
-int
-server_pending(void)
+static void
+epoll_add(int clinr)
 {
-    return FD_ISSET(daemon_fd, &read_fd_mask);
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = clients[clinr].events = EPOLLIN;
+    ev.data.u64 = (uint64_t)clinr;
+    syscalls[sc_ctl]++;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clinr, &ev) < 0)
+	perror("epoll_ctl");
 }
 
-int
-server_accept(void)
+/* Tell epoll if the client wants to read or write */
+static void
+epoll_update(int clinr)
 {
-    struct sockaddr_storage from;
-    socklen_t len = sizeof(from);
-    int i = accept(daemon_fd, (struct sockaddr *)&from, &len);
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if(input_room(clinr))
+	events |= EPOLLIN;
+    if(clients[clinr].want_write)
+	events |= EPOLLOUT;
+    if(events == clients[clinr].events)
+	return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = clients[clinr].events = events;
+    ev.data.u64 = (uint64_t)clinr;
+    syscalls[sc_ctl]++;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, clinr, &ev) < 0)
+	perror("epoll_ctl");
+}
 
-    if(i < 0) {
-	perror("server_accept");
-	return -1;
+static int
+epoll_wait_events(int timeout)
+{
+    static struct epoll_event events[256];
+    int i, n;
+
+    syscalls[sc_wait]++;
+    n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+    loop_woke = now_ns();
+    for(i = 0; i < n; i++) {
+	int j = (int)(events[i].data.u64 & 0xffffffff);
+	if(events[i].data.u64 & EPOLL_LISTENER) {
+	    listener_ready(&listeners[j]);
+	    continue;
+	}
+	if(!clients[j].is_connected) continue;
+	if((events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && read_input(j) < 0)
+	    clients[j].mode |= SM_QUITING;
+	if((events[i].events & EPOLLOUT) && !(clients[j].mode & SM_QUITING))
+	    client_writable(j);
     }
+    return n;
+}
+#endif				/* HAVE_EPOLL */
 
-    FD_CLR(daemon_fd, &read_fd_mask);
+#if HAVE_IO_URING
+/*
+ * The io_uring backend.
+ *
+ * A multishot accept gives new connections and a multishot recv per
+ * client puts the input into buffers from a provided buffer ring, so
+ * no syscalls are needed to read. All output is queued, and the queued
+ * blocks are sent with linked sends, so they arrive in order. The
+ * submissions and the wait for completions are a single io_uring_enter.
+ */
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 4096
+#endif
+#ifndef URING_BUFS
+#define URING_BUFS 1024		/* The number of provided recv buffers */
+#endif
+#ifndef URING_BUF_LEN
+#define URING_BUF_LEN 4096
+#endif
+#define URING_BGID 1
+#define URING_MAX_LINK 8	/* Linked sends per client at once */
+
+/* What a completion is for. The session in user_data tells if it is
+ * for a connection that has since been closed. */
+enum { op_accept = 1, op_recv, op_send, op_cancel };
+#define URING_DATA(op, fd, session) \
+    (((uint64_t)(session) << 32) | ((uint64_t)(op) << 24) | (uint64_t)(fd))
+
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;	/* Up to here are prepared, but not submitted */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned short br_tail;
+    bool no_multishot_recv;	/* The kernel is too old for it */
+} uring;
+
+/* Connections that have been accepted, for server_accept() */
+static struct {
+    int fd;
+    int listener;
+} *accepted;
+static int n_accepted;
+
+/* The output of closed clients that the kernel may still be sending */
+typedef struct orphan {
+    struct orphan *next;
+    uint32_t session;
+    int sending;
+    output_queue *queue;
+} orphan;
+static orphan *orphans;
 
-    if(i >= MAX_FD) {
-	close(i);	/* A message or a hook should perhapps be put here */
-	return -1;
+static int
+uring_enter(unsigned to_submit, unsigned wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+
+    memset(&arg, 0, sizeof(arg));
+    if(wait) {
+	flags |= IORING_ENTER_GETEVENTS;
+	if(timeout >= 0) {
+	    ts.tv_sec = timeout / 1000;
+	    ts.tv_nsec = (timeout % 1000) * 1000000L;
+	    arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
     }
+    syscalls[sc_wait]++;
+    return syscall(__NR_io_uring_enter, uring.fd, to_submit, wait, flags,
+                   &arg, sizeof(arg));
+}
 
-    memset(&clients[i], 0, sizeof(clients[i]));
+static void
+uring_submit(int wait, int timeout)
+{
+    unsigned to_submit = uring.sq_local_tail - *uring.sq_tail;
 
-    memcpy(&clients[i].address, &from, sizeof(clients[i].address));
-    clients[i].address_len = len;
+    __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+    if(uring_enter(to_submit, wait, timeout) < 0 &&
+       errno != EINTR && errno != ETIME && errno != EBUSY)
+	perror("io_uring_enter");
+}
 
-    if(i >= high_fd) high_fd = i + 1;
-    clients[i].curr = 0;
-    clients[i].mode = 0;
-    FD_SET(i, &select_fd_mask);
-#if HAVE_ZLIB
-    clients[i].stream = NULL;
-#endif
-    clients[i].writebuff = NULL;
-    clients[i].writelen = 0;
-    clients[i].x_size = clients[i].y_size = 0;
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if(uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) ==
+       uring.sq_entries)
+	uring_submit(0, 0);
+    index = uring.sq_local_tail & *uring.sq_mask;
+    sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index] = index;
+    uring.sq_local_tail++;
+    return sqe;
+}
 
-    clients[i].is_connected = true;
+/* Give a buffer back to the provided buffer ring */
+static void
+uring_recycle(int bid)
+{
+    struct io_uring_buf *buf = &uring.br->bufs[uring.br_tail & (URING_BUFS - 1)];
 
-    telnet_enable_us_option(i, CHARSETc);
-    telnet_enable_us_option(i, EORc);
-    telnet_enable_him_option(i, NAWSc);
-    // telnet_enable_us_option(i, SGAc);
-    telnet_enable_him_option(i, TTc);
-    telnet_enable_us_option(i, ZMPc);
-#if HAVE_ZLIB
-    telnet_enable_us_option(i, COMPRESS2c);
-#endif
+    buf->addr = (uint64_t)(uintptr_t)(uring.bufs + (size_t)bid * URING_BUF_LEN);
+    buf->len = URING_BUF_LEN;
+    buf->bid = bid;
+    uring.br_tail++;
+    __atomic_store_n(&uring.br->tail, uring.br_tail, __ATOMIC_RELEASE);
+}
 
-    return i;
+/* The accept completions have the listener's index instead of an fd */
+static void
+uring_arm_accept(int index)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listeners[index].fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_DATA(op_accept, index, 0);
 }
 
-int
-server_ready(int clientnr)
-/* Is the clientnr client ready with a line ? */
+static void
+uring_arm_recv(int clinr)
 {
-    return FD_ISSET(clientnr, &read_fd_mask);
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = clinr;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    if(!uring.no_multishot_recv)
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_DATA(op_recv, clinr, clients[clinr].session);
+    clients[clinr].receiving = true;
 }
 
-int
-server_close(int clientnr)
-/* Close and dealloc everything that has to do with the <clientnr> client. */
+/* Stop the client's multishot recv, it has sent too much */
+static void
+uring_cancel_recv(int clinr)
 {
-    clients[clientnr].is_connected = false;
-    clients[clientnr].mode = 0;
-    FD_CLR(clientnr, &select_write_fd_mask);
-    FD_CLR(clientnr, &select_fd_mask);
-    FD_CLR(clientnr, &read_fd_mask);
-    FD_CLR(clientnr, &write_fd_mask);
-    while(!FD_ISSET(high_fd - 1, &select_fd_mask))
-	--high_fd;
-    while(clients[clientnr].writebuff) {
-        output_queue *next = clients[clientnr].writebuff->next;
-        free(clients[clientnr].writebuff);
-        clients[clientnr].writebuff = next;
-    }
-    key_value *curr = clients[clientnr].variables;
-    while(curr) {
-	key_value *next = curr->next;
-	free(curr->key);
-	free(curr->value);
-	free(curr);
-	curr = next;
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_DATA(op_recv, clinr, clients[clinr].session);
+    sqe->user_data = URING_DATA(op_cancel, clinr, clients[clinr].session);
+}
+
+/* Send the head of the client's output queue, with linked sends */
+static void
+uring_send(int clinr)
+{
+    output_queue *q = clients[clinr].writebuff;
+    struct io_uring_sqe *sqe = NULL;
+    int n = 0;
+
+    if(clients[clinr].sending)
+	return;
+    while(q && n < URING_MAX_LINK) {
+	unsigned len = q->end - q->start;
+	if(clients[clinr].fragment && len > clients[clinr].fragment)
+	    len = clients[clinr].fragment;
+	if(sqe)
+	    sqe->flags |= IOSQE_IO_LINK;
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = clinr;
+	sqe->addr = (uint64_t)(uintptr_t)(q->text + q->start);
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = URING_DATA(op_send, clinr, clients[clinr].session);
+	n++;
+	if(clients[clinr].fragment)
+	    break;
+	q = q->next;
     }
-    shutdown(clientnr, SHUT_RDWR);
-    return close(clientnr);
+    clients[clinr].sending = n;
 }
 
-int
-server_prompt(int clientnr, const char *prompt, int size)
+/* The client is closed, but its output may still be read by the kernel */
+static void
+orphan_output(int clinr)
 {
-    if(should_echo(clientnr)) {
-	char buff[LINELEN + 80 + 3];	/* 80 = max length of the prompt */
-	strncpy(buff, prompt, size);
-	strncpy(&buff[size], clients[clientnr].holdbuff,
-		clients[clientnr].curr);
-	server_write(clientnr, buff, size + clients[clientnr].curr, SW_DO_FLUSH);
-    } else {
-	char buff[LINELEN + 80 + 3];
-	strncpy(buff, prompt, size);
-	if(clients[clientnr].mode & SM_EORECORDS) {
-	    buff[size++] = IACc;
-	    buff[size++] = '\357';	/* IAC END-OF-RECORD */
+    orphan *o = malloc(sizeof(orphan));
+
+    o->session = clients[clinr].session;
+    o->sending = clients[clinr].sending;
+    o->queue = clients[clinr].writebuff;
+    o->next = orphans;
+    orphans = o;
+    clients[clinr].writebuff = NULL;
+    clients[clinr].sending = 0;
+}
+
+/* A send for a closed client has completed */
+static void
+orphan_sent(uint32_t session)
+{
+    orphan **op;
+
+    for(op = &orphans; *op; op = &(*op)->next) {
+	orphan *o = *op;
+	if(o->session != session) continue;
+	if(--o->sending == 0) {
+	    while(o->queue) {
+		output_queue *next = o->queue->next;
+		pool_put(&block_pool, o->queue);
+		o->queue = next;
+	    }
+	    *op = o->next;
+	    free(o);
 	}
-	server_write(clientnr, buff, size, SW_DO_FLUSH);
+	return;
     }
-    return 0;
 }
 
-/* It is assumed that telnet characters are already properly
- * escaped when server_write is called.
- *
- * flags can be:
+static void
+uring_complete(struct io_uring_cqe *cqe)
+{
+    int op = (cqe->user_data >> 24) & 255;
+    int fd = cqe->user_data & 0xffffff;
+    uint32_t session = cqe->user_data >> 32;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    bool stale = op != op_accept &&
+                 (!clients[fd].is_connected || clients[fd].session != session);
+
+    switch(op) {
+	case op_accept:
+	    if(cqe->res >= 0) {
+		if(cqe->res >= max_fd) {
+		    close(cqe->res);
+		} else if(listeners[fd].kind == listen_metrics) {
+		    http_accept(cqe->res);
+		} else {
+		    accepted[n_accepted].fd = cqe->res;
+		    accepted[n_accepted++].listener = fd;
+		    accept_pending = true;
+		}
+	    } else if(cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+		errno = -cqe->res;
+		perror("server_accept");
+	    }
+	    if(!more)
+		uring_arm_accept(fd);
+	    break;
+	case op_recv:
+	    if(cqe->flags & IORING_CQE_F_BUFFER) {
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(cqe->res > 0 && !stale) {
+		    const char *data = uring.bufs + (size_t)bid * URING_BUF_LEN;
+		    memcpy(input_space(fd, cqe->res), data, cqe->res);
+		    record_packet(fd, REC_IN, data, cqe->res);
+		    bytes_in += cqe->res;
+		    clients[fd].inlen += cqe->res;
+		    clients[fd].last_input = now_ns();
+		    if(clients[fd].quickack)
+			set_tcp_option(fd, tcp_quickack, 1);
+		}
+		uring_recycle(bid);
+	    }
+	    if(stale)
+		break;
+	    if(cqe->res == -EINVAL && !uring.no_multishot_recv) {
+		/* Before Linux 6.0 */
+		uring.no_multishot_recv = true;
+	    } else if(cqe->res == 0 ||
+	              (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+		clients[fd].mode |= SM_QUITING;
+	    } else if(more && !input_room(fd)) {
+		uring_cancel_recv(fd);
+	    }
+	    if(!more)
+		clients[fd].receiving = false;
+	    break;
+	case op_send:
+	    if(stale) {
+		orphan_sent(session);
+		break;
+	    }
+	    clients[fd].sending--;
+	    if(cqe->res > 0) {
+		output_sent(fd, cqe->res);
+	    } else if(cqe->res < 0 && cqe->res != -ECANCELED && cqe->res != -EAGAIN &&
+	              cqe->res != -EINTR) {
+		clients[fd].mode |= SM_QUITING;
+	    }
+	    if(!clients[fd].sending && !(clients[fd].mode & SM_QUITING))
+		client_writable(fd);
+	    break;
+    }
+}
+
+/* Handle the completions that have arrived */
+static int
+uring_reap(void)
+{
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while(head != tail) {
+	uring_complete(&uring.cqes[head & *uring.cq_mask]);
+	head++;
+	n++;
+	/* Completions may have added more */
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return n;
+}
+
+static bool
+uring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    char *sq_ring, *cq_ring;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(uring.fd < 0)
+	return false;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+       !(p.features & IORING_FEAT_EXT_ARG) ||
+       !(p.features & IORING_FEAT_NODROP)) {
+	close(uring.fd);
+	return false;
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(cq_size > sq_size)
+	sq_size = cq_size;
+    sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.fd, IORING_OFF_SQES);
+    if(sq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+	close(uring.fd);
+	return false;
+    }
+    cq_ring = sq_ring;
+    uring.sq_head = (unsigned *)(sq_ring + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq_ring + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq_ring + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq_ring + p.sq_off.array);
+    uring.sq_entries = p.sq_entries;
+    uring.sq_local_tail = *uring.sq_tail;
+    uring.cq_head = (unsigned *)(cq_ring + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq_ring + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq_ring + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+
+    /* The provided buffers for recv, Linux 5.19 and later */
+    uring.br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(uring.br == MAP_FAILED) {
+	close(uring.fd);
+	return false;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring.br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if(syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+	close(uring.fd);
+	return false;
+    }
+    uring.bufs = malloc((size_t)URING_BUFS * URING_BUF_LEN);
+    uring.br_tail = 0;
+    for(i = 0; i < URING_BUFS; i++)
+	uring_recycle(i);
+
+    /* io_uring waits for the connections itself */
+    for(i = 0; i < n_listeners; i++) {
+	fcntl(listeners[i].fd, F_SETFL, fcntl(listeners[i].fd, F_GETFL) & ~O_NONBLOCK);
+	uring_arm_accept(i);
+    }
+    return true;
+}
+#endif				/* HAVE_IO_URING */
+
+/* Pick the best backend there is, or the one that was asked for.
+ * Returns false if the wanted one doesn't work. */
+static bool
+backend_init(const char *wanted)
+{
+#if HAVE_IO_URING
+    if(!wanted || !strcmp(wanted, "io_uring")) {
+	if(uring_init()) {
+	    backend = backend_io_uring;
+	    return true;
+	}
+	if(wanted) return false;
+    }
+#endif
+#if HAVE_EPOLL
+    if(!wanted || !strcmp(wanted, "epoll")) {
+	if(epoll_init()) {
+	    backend = backend_epoll;
+	    return true;
+	}
+	if(wanted) return false;
+    }
+#endif
+    if(!wanted || !strcmp(wanted, "select")) {
+	backend = backend_select;
+	return true;
+    }
+    return false;
+}
+
+/* The client does or does not have output to send */
+static void
+want_write(int clinr, bool on)
+{
+    if(clients[clinr].want_write == on)
+	return;
+    clients[clinr].want_write = on;
+#if HAVE_EPOLL
+    if(backend == backend_epoll && clients[clinr].is_connected)
+	epoll_update(clinr);
+#endif
+}
+
+/* The loop is about to wait, the turn that began at loop_woke is done */
+static void
+loop_turn_done(uint64_t entered)
+{
+    uint64_t now = now_ns(), busy;
+
+    if(!loop_woke)
+	return;
+    loop_work(-1, "input and output", now - entered);
+    busy = now - loop_woke;
+    hist_add(&loop_time, busy);
+    if(busy > stall_ns) {
+	stalls++;
+	if(slowest.fd >= 0)
+	    printf("Stall: the loop was busy for %.1f ms, %.1f ms of it with"
+	           " \"%s\" from fd %d\n", busy / 1e6, slowest.ns / 1e6,
+	           slowest.what, slowest.fd);
+	else
+	    printf("Stall: the loop was busy for %.1f ms, %.1f ms of it in %s\n",
+	           busy / 1e6, slowest.ns / 1e6, slowest.what);
+	fflush(stdout);
+    }
+    slowest.ns = 0;
+}
+
+/*
+ * Wait for input, output space or new connections, for at most sec
+ * seconds and usec micro seconds (forever if both are 0).
+ * Returns the number of clients with something to do, including the
+ * ones that are ready with a line.
+ */
+int
+server_poll(long sec, long usec)
+{
+    uint64_t entered = now_ns();
+    int j, ready = 0;
+    int timeout = (sec || usec) ? sec * 1000 + usec / 1000 : -1;
+
+    /* What is already buffered is parsed before waiting for more */
+    for(j = 0; j < high_fd; j++) {
+	if(!clients[j].is_connected) continue;
+	if(clients[j].input_done && !clients[j].line_ready &&
+	   !clients[j].writelen && !clients[j].producer)
+	    clients[j].mode |= SM_QUITING;
+	if(parse_input(j) || (clients[j].mode & SM_QUITING))
+	    ready++;
+#if HAVE_EPOLL
+	if(backend == backend_epoll)
+	    epoll_update(j);
+#endif
+#if HAVE_IO_URING
+	if(backend == backend_io_uring) {
+	    if(!clients[j].receiving && input_room(j))
+		uring_arm_recv(j);
+	    if(clients[j].want_write && !clients[j].sending && !clients[j].writelen)
+		client_writable(j);
+	    if(clients[j].writelen && !clients[j].sending)
+		uring_send(j);
+	}
+#endif
+    }
+    if(ready || accept_pending)
+	timeout = 0;
+
+    loop_turn_done(entered);
+    switch(backend) {
+#if HAVE_IO_URING
+	case backend_io_uring:
+	    uring_submit(timeout != 0, timeout);
+	    loop_woke = now_ns();
+	    uring_reap();
+	    break;
+#endif
+#if HAVE_EPOLL
+	case backend_epoll:
+	    epoll_wait_events(timeout);
+	    break;
+#endif
+	default:
+	    select_wait(timeout);
+	    break;
+    }
+
+    if(metrics_pending)
+	metrics_accept();
+    ready = accept_pending;
+    for(j = 0; j < high_fd; j++) {
+	if(!clients[j].is_connected) continue;
+	if(clients[j].http) {
+	    parse_input(j);
+	    if((clients[j].mode & SM_QUITING) ||
+	       (clients[j].http_done && !clients[j].writelen && !clients[j].sending))
+		server_close(j);
+	    continue;
+	}
+	if(parse_input(j) || (clients[j].mode & SM_QUITING))
+	    ready++;
+    }
+    loop_work(-1, "input and output", now_ns() - loop_woke);
+    return ready;
+}
+
+int
+server_pending(void)
+{
+    return accept_pending;
+}
+
+/* Give the client's queued output to the kernel now. The tests that
+ * sleep between their writes call it before they sleep, as the output
+ * is corked, or queued for io_uring, until the line is done. */
+static void
+server_flush(int clinr)
+{
+    if(!clients[clinr].writelen)
+	return;
+#if HAVE_IO_URING
+    if(backend == backend_io_uring) {
+	/* The completions are left for server_poll(), as they may run
+	 * the producer that is calling this */
+	if(!clients[clinr].sending)
+	    uring_send(clinr);
+	uring_submit(0, 0);
+	return;
+    }
+#endif
+    if(!flush_output(clinr))
+	clients[clinr].mode |= SM_QUITING;
+}
+
+/* Queue the client's output until server_uncork(), so the output of
+ * a batch of lines is sent with one write. */
+void
+server_cork(int clientnr)
+{
+    clients[clientnr].corked = true;
+}
+
+void
+server_uncork(int clientnr)
+{
+    clients[clientnr].corked = false;
+    if(clients[clientnr].is_connected)
+	server_flush(clientnr);
+}
+
+/* The options that are negotiated when a client connects */
+static const struct {
+    char option;
+    bool us;			/* WILL if true, DO otherwise */
+} connect_options[] = {
+    { CHARSETc, true },
+    { EORc, true },
+    { NAWSc, false },
+    // { SGAc, true },
+    { TTc, false },
+    { ZMPc, true },
+#if HAVE_ZLIB
+    { COMPRESS2c, true },
+#endif
+};
+
+/* What is sent to a new client: the negotiations, with their debug
+ * lines, and the welcome text. Made once by make_connect_blob(). */
+static char *connect_blob;
+static int connect_blob_len;
+
+static void
+make_connect_blob(void)
+{
+    static const char welcome[] =
+        "\r\n" "\r\n"
+        "Welcome to the Mud Client Test Server!\r\n"
+        "Server version: " VERSION " compiled at " __DATE__ "\r\n" "\r\n"
+        "Write ? for help\r\n" "\r\n";
+    char buff[4096];
+    int len = 0;
+    size_t i;
+
+    for(i = 0; i < sizeof(connect_options) / sizeof(connect_options[0]); i++) {
+	char c = connect_options[i].option;
+	len += snprintf(buff + len, sizeof(buff) - len,
+	                "%c%c%cSENT IAC %s %s (us_q=%s)\r\n",
+	                IACc, connect_options[i].us ? WILLc : DOc, c,
+	                connect_options[i].us ? "WILL" : "DO",
+	                get_telnet_option(c),
+	                get_telnet_state(tos_WANTYES_EMPTY));
+    }
+    len += snprintf(buff + len, sizeof(buff) - len, "%s", welcome);
+    connect_blob = malloc(len);
+    memcpy(connect_blob, buff, len);
+    connect_blob_len = len;
+}
+
+/*
+ * Set up a connected client and start the option negotiation.
+ * Returns its number, i.
+ */
+static int
+client_start(int i, int from_listener, const struct sockaddr_storage *from, socklen_t len)
+{
+    size_t j;
+
+    memset(&clients[i], 0, sizeof(clients[i]));
+    clients[i].listener = from_listener;
+    /* There are no other clients with --stdio */
+    clients[i].stdio = stdio_out >= 0;
+
+    memcpy(&clients[i].address, from, sizeof(clients[i].address));
+    clients[i].address_len = len;
+
+    if(i >= high_fd) high_fd = i + 1;
+    clients[i].curr = 0;
+    clients[i].mode = 0;
+#if HAVE_EPOLL
+    if(backend == backend_epoll)
+	epoll_add(i);
+#endif
+#if HAVE_ZLIB
+    clients[i].stream = NULL;
+#endif
+    clients[i].writebuff = NULL;
+    clients[i].writetail = NULL;
+    clients[i].writelen = 0;
+    clients[i].high_water = default_high_water;
+    clients[i].low_water = default_low_water;
+    clients[i].drop_at = default_drop_at;
+    clients[i].x_size = clients[i].y_size = 0;
+    clients[i].last_input = now_ns();
+    clients[i].idle_timeout = default_idle_timeout;
+    if(default_idle_timeout)
+	set_timer(i, timer_idle, clients[i].last_input + default_idle_timeout * 1000000000ULL);
+    if(keepalive_interval)
+	set_timer(i, timer_keepalive, clients[i].last_input + keepalive_interval * 1000000000ULL);
+    if(tcp_keepalive) {
+	int on = 1;
+	setsockopt(i, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+	setsockopt(i, IPPROTO_TCP, TCP_KEEPIDLE, &tcp_keepalive, sizeof(tcp_keepalive));
+	setsockopt(i, IPPROTO_TCP, TCP_KEEPINTVL, &tcp_keepalive, sizeof(tcp_keepalive));
+#endif
+    }
+    if(from->ss_family == AF_UNIX) {
+	/* Unlike TCP's, unix sockets get their own buffers on accept */
+	for(j = 0; j < tcp_count; j++)
+	    if(listeners[from_listener].tcp[j] >= 0)
+		set_tcp_option(i, j, listeners[from_listener].tcp[j]);
+    }
+    clients[i].quickack = listeners[from_listener].tcp[tcp_quickack] > 0;
+    if(clients[i].quickack)
+	set_tcp_option(i, tcp_quickack, 1);
+
+    clients[i].is_connected = true;
+    clients[i].session = ++next_session;
+    if(record_fd >= 0) {
+        char buffer[100];
+        client_address(i, buffer, sizeof(buffer));
+        record_packet(i, REC_CONNECT, buffer, strlen(buffer));
+    }
+
+    /* The same as calling telnet_enable_us/him_option for each of the
+     * options, but with a single write. */
+    for(j = 0; j < sizeof(connect_options) / sizeof(connect_options[0]); j++) {
+	if(connect_options[j].us)
+	    clients[i].tos_us[(unsigned char)connect_options[j].option] = tos_WANTYES_EMPTY;
+	else
+	    clients[i].tos_him[(unsigned char)connect_options[j].option] = tos_WANTYES_EMPTY;
+    }
+    server_write(i, connect_blob, connect_blob_len, 0);
+
+    return i;
+}
+
+/*
+ * Accept a new connection. Returns -1 when no more connections are
+ * waiting, call it until it does to empty the listen queue.
+ */
+int
+server_accept(void)
+{
+    struct sockaddr_storage from;
+    socklen_t len;
+    int i, from_listener;
+
+#if HAVE_IO_URING
+    if(backend == backend_io_uring) {
+	/* The connections were accepted by io_uring_reap() */
+	if(!n_accepted) {
+	    accept_pending = false;
+	    return -1;
+	}
+	n_accepted--;
+	i = accepted[n_accepted].fd;
+	from_listener = accepted[n_accepted].listener;
+	len = sizeof(from);
+	syscalls[sc_accept]++;
+	getpeername(i, (struct sockaddr *)&from, &len);
+    } else
+#endif
+    for(;;) {
+	listener *l = pending_listener(listen_telnet);
+	if(!l) {
+	    accept_pending = false;
+	    return -1;
+	}
+	len = sizeof(from);
+	syscalls[sc_accept]++;
+#ifdef SOCK_NONBLOCK
+	i = accept4(l->fd, (struct sockaddr *)&from, &len,
+	            SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	i = accept(l->fd, (struct sockaddr *)&from, &len);
+	if(i >= 0)
+	    fcntl(i, F_SETFL, fcntl(i, F_GETFL) | O_NONBLOCK);
+#endif
+	if(i < 0) {
+	    if(errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if(errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("server_accept");
+	    l->pending = false;
+	    continue;
+	}
+	if(i < max_fd) {
+	    from_listener = l - listeners;
+	    break;
+	}
+	close(i);	/* A message or a hook should perhapps be put here */
+    }
+
+    accepts++;
+    return client_start(i, from_listener, &from, len);
+}
+
+/*
+ * --stdio: stdin becomes the only client, and its output is written
+ * to stdio_out. Returns its number.
+ */
+static int
+stdio_start(void)
+{
+    struct sockaddr_storage none;
+
+    stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+    stdout_flags = fcntl(stdio_out, F_GETFL);
+    fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK);
+    fcntl(stdio_out, F_SETFL, stdout_flags | O_NONBLOCK);
+    /* select() must look at stdio_out too */
+    if(stdio_out >= high_fd)
+	high_fd = min_high_fd = stdio_out + 1;
+    memset(&none, 0, sizeof(none));
+    return client_start(STDIN_FILENO, 0, &none, 0);
+}
+
+int
+server_ready(int clientnr)
+/* Is the clientnr client ready with a line ? */
+{
+    return clients[clientnr].is_connected && !clients[clientnr].http &&
+           (parse_input(clientnr) || (clients[clientnr].mode & SM_QUITING));
+}
+
+int
+server_close(int clientnr)
+/* Close and dealloc everything that has to do with the <clientnr> client. */
+{
+    int i;
+
+    /* Send what the lines before the close wrote */
+    if(clients[clientnr].corked)
+	server_uncork(clientnr);
+    record_packet(clientnr, REC_CLOSE, NULL, 0);
+    clients[clientnr].is_connected = false;
+    clients[clientnr].mode = 0;
+    clients[clientnr].line_ready = false;
+    clients[clientnr].want_write = false;
+    clients[clientnr].corked = false;
+    clients[clientnr].deficit = 0;
+    clients[clientnr].events = 0;
+    clients[clientnr].receiving = false;
+    while(high_fd > min_high_fd && !clients[high_fd - 1].is_connected)
+	--high_fd;
+    free(clients[clientnr].inbuf);
+    clients[clientnr].inbuf = NULL;
+    clients[clientnr].inpos = clients[clientnr].inlen = clients[clientnr].insize = 0;
+    free(clients[clientnr].line);
+    clients[clientnr].line = NULL;
+    clients[clientnr].line_size = clients[clientnr].line_len = 0;
+    free(clients[clientnr].sb);
+    clients[clientnr].sb = NULL;
+    clients[clientnr].sb_size = clients[clientnr].sb_len = 0;
+    clients[clientnr].line_too_long = false;
+    clients[clientnr].sb_too_long = false;
+#if HAVE_ZLIB
+    if(clients[clientnr].stream) {
+	mccp_in += clients[clientnr].stream->total_in;
+	mccp_out += clients[clientnr].stream->total_out;
+	deflateEnd(clients[clientnr].stream);
+	free(clients[clientnr].stream);
+	free(clients[clientnr].comp_buffer);
+	clients[clientnr].stream = NULL;
+	clients[clientnr].comp_buffer = NULL;
+    }
+#endif
+#if HAVE_IO_URING
+    /* The shutdown() below ends the client's recv */
+    if(clients[clientnr].sending) {
+	/* The kernel may still read the blocks */
+	orphan_output(clientnr);
+    }
+#endif
+    while(clients[clientnr].writebuff) {
+        output_queue *next = clients[clientnr].writebuff->next;
+        pool_put(&block_pool, clients[clientnr].writebuff);
+        clients[clientnr].writebuff = next;
+    }
+    while(clients[clientnr].deferred) {
+        output_queue *next = clients[clientnr].deferred->next;
+        pool_put(&block_pool, clients[clientnr].deferred);
+        clients[clientnr].deferred = next;
+    }
+    clients[clientnr].writetail = NULL;
+    clients[clientnr].deferred_tail = NULL;
+    clients[clientnr].writelen = 0;
+    clients[clientnr].deferlen = 0;
+    stop_producer(clientnr);
+    for(i = 0; i < timer_count; i++)
+	set_timer(clientnr, i, 0);
+    if(clients[clientnr].zmp_echo) {
+	hist_merge(&zmp_echo_rtt, &clients[clientnr].zmp_echo->rtt);
+	free(clients[clientnr].zmp_echo);
+	clients[clientnr].zmp_echo = NULL;
+    }
+    if(clients[clientnr].tilestorm) {
+	tilestorm_free(clients[clientnr].tilestorm);
+	clients[clientnr].tilestorm = NULL;
+    }
+    key_value *curr = clients[clientnr].variables;
+    while(curr) {
+	key_value *next = curr->next;
+	pool_strfree(curr->key);
+	pool_strfree(curr->value);
+	pool_put(&var_pool, curr);
+	curr = next;
+    }
+    if(clients[clientnr].stdio) {
+	/* The session was all there was to do */
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+	fcntl(stdio_out, F_SETFL, stdout_flags);
+	close(stdio_out);
+	stop_requested = 1;
+	return close(clientnr);
+    }
+    shutdown(clientnr, SHUT_RDWR);
+    return close(clientnr);
+}
+
+int
+server_prompt(int clientnr, const char *prompt, int size)
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = (char *)prompt;
+    iov[0].iov_len = size;
+    if(should_echo(clientnr)) {
+	iov[1].iov_base = clients[clientnr].line;
+	iov[1].iov_len = clients[clientnr].curr;
+    } else {
+	iov[1].iov_base = IAC "\357";	/* IAC END-OF-RECORD */
+	iov[1].iov_len = (clients[clientnr].mode & SM_EORECORDS) ? 2 : 0;
+    }
+    server_writev(clientnr, iov, iov[1].iov_len ? 2 : 1, SW_DO_FLUSH);
+    return 0;
+}
+
+/* Copy the data to the end of a list of output blocks */
+static void
+append_blocks(output_queue **head, output_queue **tail, const char *mesg, int mesglen)
+{
+    output_queue *last = *tail;
+
+    if(last && last->end < BLOCK_SIZE) {
+	/* Fill the last block first */
+	int size = mesglen;
+	if(size > BLOCK_SIZE - last->end)
+	    size = BLOCK_SIZE - last->end;
+	memcpy(&last->text[last->end], mesg, size);
+	last->end += size;
+	mesg += size;
+	mesglen -= size;
+    }
+    while(mesglen > 0) {
+	output_queue *noq = pool_get(&block_pool);
+	int size = mesglen > BLOCK_SIZE ? BLOCK_SIZE : mesglen;
+
+	noq->next = NULL;
+	noq->start = 0;
+	noq->end = size;
+	memcpy(noq->text, mesg, size);
+	mesg += size;
+	mesglen -= size;
+	if(last)
+	    last->next = noq;
+	else
+	    *head = noq;
+	last = noq;
+    }
+    *tail = last;
+}
+
+/* Put the data last in the client's output queue, it is sent
+ * when the socket becomes writable. */
+static void
+queue_output(int clientnr, const char *mesg, int mesglen)
+{
+    want_write(clientnr, true);
+    append_blocks(&clients[clientnr].writebuff, &clients[clientnr].writetail,
+                  mesg, mesglen);
+    clients[clientnr].writelen += mesglen;
+    if(clients[clientnr].writelen > clients[clientnr].max_writelen)
+	clients[clientnr].max_writelen = clients[clientnr].writelen;
+}
+
+/* Keep a broadcast until the client's output queue has drained */
+static void
+defer_output(int clientnr, const char *mesg, int mesglen)
+{
+    if(clients[clientnr].writelen + clients[clientnr].deferlen + mesglen >
+       clients[clientnr].drop_at) {
+	clients[clientnr].mode |= SM_QUITING;
+	dropped_clients++;
+	return;
+    }
+    append_blocks(&clients[clientnr].deferred, &clients[clientnr].deferred_tail,
+                  mesg, mesglen);
+    clients[clientnr].deferlen += mesglen;
+    deferred_bytes += mesglen;
+    want_write(clientnr, true);
+}
+
+/* Send the kept back broadcasts */
+static void
+release_deferred(int clientnr)
+{
+    output_queue *q = clients[clientnr].deferred;
+
+    clients[clientnr].deferred = clients[clientnr].deferred_tail = NULL;
+    clients[clientnr].deferlen = 0;
+    while(q) {
+	output_queue *next = q->next;
+	server_write(clientnr, q->text + q->start, q->end - q->start, 0);
+	pool_put(&block_pool, q);
+	q = next;
+    }
+    server_write(clientnr, "", 0, SW_DO_FLUSH);
+}
+
+/* Send the text to all clients. Clients that are behind get it when
+ * they have caught up, so they are not dropped. */
+static void
+broadcast(const char *text)
+{
+    int i, len = strlen(text);
+    for(i = 0; i < high_fd; i++) {
+	if(!clients[i].is_connected || clients[i].http) continue;
+	if(clients[i].deferred ||
+	   clients[i].writelen >= clients[i].high_water) {
+	    defer_output(i, text, len);
+	} else {
+	    server_write(i, text, len, SW_DO_FLUSH);
+	}
+    }
+}
+
+/* Send as much as possible of the client's output queue.
+ * Returns false if the connection has failed. */
+static bool
+flush_output(int clientnr)
+{
+    struct iovec iov[64];
+    output_queue *q = clients[clientnr].writebuff;
+    ssize_t sent;
+    int n = 0;
+
+    while(q && n < 64) {
+	iov[n].iov_base = q->text + q->start;
+	iov[n].iov_len = q->end - q->start;
+	n++;
+	q = q->next;
+    }
+    if(!n) return true;
+    hist_add(&queue_depth, clients[clientnr].writelen);
+#if HAVE_IO_URING
+    if(backend == backend_io_uring) {
+	uring_send(clientnr);
+	return true;
+    }
+#endif
+    if(clients[clientnr].fragment) {
+	n = 1;
+	if(iov[0].iov_len > clients[clientnr].fragment)
+	    iov[0].iov_len = clients[clientnr].fragment;
+    }
+    syscalls[sc_send]++;
+    sent = writev(output_fd(clientnr), iov, n);
+    if(sent < 0)
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    output_sent(clientnr, sent);
+    return true;
+}
+
+/* Remove what has been sent from the client's output queue */
+static void
+output_sent(int clientnr, ssize_t sent)
+{
+    output_queue *q;
+
+    bytes_out += sent;
+    clients[clientnr].writelen -= sent;
+    while(sent > 0) {
+	q = clients[clientnr].writebuff;
+	int size = q->end - q->start;
+	if(size > sent) size = sent;
+	record_packet(clientnr, REC_OUT, q->text + q->start, size);
+	q->start += size;
+	sent -= size;
+	if(q->start == q->end) {
+	    clients[clientnr].writebuff = q->next;
+	    pool_put(&block_pool, q);
+	}
+    }
+    if(!clients[clientnr].writebuff) {
+	clients[clientnr].writetail = NULL;
+	if(!clients[clientnr].producer && !clients[clientnr].deferred)
+	    want_write(clientnr, false);
+    }
+}
+
+/* Stop the client's producer, if it has one */
+static void
+stop_producer(int clinr)
+{
+    if(clients[clinr].producer_data) {
+	if(clients[clinr].producer_stop)
+	    clients[clinr].producer_stop(clients[clinr].producer_data);
+	else
+	    free(clients[clinr].producer_data);
+    }
+    clients[clinr].producer = NULL;
+    clients[clinr].producer_data = NULL;
+    clients[clinr].producer_stop = NULL;
+    clients[clinr].paused = false;
+}
+
+/* Give the client a producer. Any old producer is stopped.
+ * stop is called to free data, if it is NULL, free() is used. */
+static void
+start_producer(int clinr, bool (*producer)(int clinr), void *data,
+               void (*stop)(void *data))
+{
+    stop_producer(clinr);
+    clients[clinr].producer = producer;
+    clients[clinr].producer_data = data;
+    clients[clinr].producer_stop = stop;
+}
+
+/*
+ * Let the client's producer write until the client's high water mark
+ * is reached, but at most PRODUCER_BUDGET bytes, to be fair to the
+ * other clients. The write mask stays set while the producer has more
+ * to say, so it is called again when the queue has shrunk to the low
+ * water mark.
+ */
+static void
+run_producer(int clinr)
+{
+    int rounds = PRODUCER_BUDGET / PRODUCER_CHUNK;
+
+    clients[clinr].paused = false;
+    while(clients[clinr].producer &&
+          clients[clinr].writelen < clients[clinr].high_water &&
+          !(clients[clinr].mode & SM_QUITING) && rounds-- > 0) {
+	if(!clients[clinr].producer(clinr)) {
+	    stop_producer(clinr);
+	    server_prompt(clinr, "> ", 2);
+	    break;
+	}
+    }
+    if(clients[clinr].producer) {
+	if(clients[clinr].writelen >= clients[clinr].high_water) {
+	    clients[clinr].paused = true;
+	    producer_pauses++;
+	}
+	want_write(clinr, true);
+    } else if(!clients[clinr].writelen && !clients[clinr].deferred) {
+	want_write(clinr, false);
+    }
+}
+
+#if HAVE_ZLIB
+/* Turn compression on or off when the client has agreed to it */
+static void
+update_compression(int clientnr)
+{
+    if((clients[clientnr].tos_us[COMPRESS2c] == tos_YES) &&
+       !clients[clientnr].stream) {
+        z_stream *stream = calloc(1, sizeof(z_stream));
+        stream->zalloc = Z_NULL;
+        stream->zfree = Z_NULL;
+        stream->opaque = Z_NULL;
+        clients[clientnr].comp_buffer = calloc(sizeof(Bytef), COMP_BUFF_LEN);
+        stream->next_out = clients[clientnr].comp_buffer;
+        stream->avail_out = COMP_BUFF_LEN;
+        if(deflateInit(stream, 6) != Z_OK) {
+            fprintf(stderr, "Failed to initialise z_stream\n");
+            free(stream);
+            return;
+        }
+        /* IAC SB COMPRESS2 IAC SE */
+        server_write(clientnr, IAC SB COMPRESS2 IAC SE, 5, SW_DONT_COMPRESS);
+
+        /* Start compression... */
+        clients[clientnr].stream = stream;
+
+        simple_write(clientnr, "SENT IAC SB COMPRESS2 IAC SE\r\n");
+    } else if((clients[clientnr].tos_us[COMPRESS2c] == tos_NO) &&
+              clients[clientnr].stream) {
+        server_write(clientnr, "Turning off COMPRESS2\r\n", 23, SW_FINISH|SW_DO_FLUSH);
+    }
+}
+#endif
+
+/* It is assumed that telnet characters are already properly
+ * escaped when server_write is called.
+ *
+ * flags can be:
  *    SW_DONT_COMPRESS - don't compress, even if the client supports
  *                       compression. Only used internally.
  *    SW_DO_FLUSH - Make sure compression buffers are sent.
  */
-int
-server_write(int clientnr, const char *mesg, int mesglen, int flags)
+int
+server_write(int clientnr, const char *mesg, int mesglen, int flags)
+{
+    int retval = 0;
+
+#if HAVE_ZLIB
+
+    if(!(flags & SW_DONT_COMPRESS) && clients[clientnr].stream) {
+        z_stream *stream = clients[clientnr].stream;
+
+        stream->next_in = (Bytef*)mesg;
+        stream->avail_in = mesglen;
+
+        while((flags & (SW_FINISH|SW_DO_FLUSH)) ||
+               stream->avail_in ||
+               stream->avail_out != COMP_BUFF_LEN) {
+
+            if(!(flags & (SW_DO_FLUSH|SW_FINISH)) &&
+               !stream->avail_in &&
+               stream->avail_out == COMP_BUFF_LEN)
+                return retval;
+
+            int z_flag = Z_NO_FLUSH;
+            if(flags & SW_FINISH) {
+                z_flag = Z_FINISH;
+            } else if(flags & SW_DO_FLUSH) {
+                z_flag = Z_SYNC_FLUSH;
+            }
+            PROF_START(deflate);
+            int z_result = deflate(stream, z_flag);
+            PROF_END(deflate);
+            switch(z_result) {
+                case Z_BUF_ERROR:
+                    /* sprintf(debug_buffer, "Got Z_BUF_ERROR %d:%d %s\r\n", stream->avail_in, COMP_BUFF_LEN - stream->avail_out, stream->msg);
+                    simple_write(clientnr, debug_buffer); */
+                    return retval;
+                case Z_STREAM_END:
+                     clients[clientnr].stream = NULL;
+                case Z_OK:
+                    if(COMP_BUFF_LEN != stream->avail_out) {
+                        retval = server_write(clientnr,
+                                              (char*)clients[clientnr].comp_buffer,
+                                              COMP_BUFF_LEN - stream->avail_out,
+                                              SW_DONT_COMPRESS);
+                        stream->next_out = clients[clientnr].comp_buffer;
+                        stream->avail_out = COMP_BUFF_LEN;
+                    }
+                    if(!clients[clientnr].stream) {
+                        mccp_in += stream->total_in;
+                        mccp_out += stream->total_out;
+                        sprintf(debug_buffer, "CompStatistics: in: %ld, out %ld %.1f%%\r\n", 
+                                    stream->total_in,
+                                    stream->total_out,
+                                    100.0*(float)stream->total_out /
+                                                 stream->total_in);
+                        deflateEnd(stream);
+                        free(stream);
+                        free(clients[clientnr].comp_buffer);
+                        clients[clientnr].comp_buffer = NULL;
+                        simple_write(clientnr, debug_buffer);
+                        return retval;
+                    }
+                    break;
+                case Z_STREAM_ERROR:
+                default:
+                    fprintf(stderr, "Something went bad with compression: %s\n", stream->msg);
+                    deflateEnd(stream);
+                    free(stream);
+                    free(clients[clientnr].comp_buffer);
+                    clients[clientnr].comp_buffer = NULL;
+                    clients[clientnr].stream = NULL;
+                    return retval;
+            }
+        }
+        return retval;
+    }
+#endif
+
+    if(mesglen == 0) return 0; // SW_DO_FLUSH for example.
+
+    PROF_START(server_write);
+    if(clients[clientnr].writelen || clients[clientnr].corked ||
+       backend == backend_io_uring) {
+	if(clients[clientnr].writelen + mesglen > clients[clientnr].drop_at) {
+	    /* The client has WAY too much queued text... Loose it! */
+	    if(!(clients[clientnr].mode & SM_QUITING))
+		dropped_clients++;
+	    clients[clientnr].mode |= SM_QUITING;
+	    want_write(clientnr, true);
+	    return -1;
+	}
+	queue_output(clientnr, mesg, mesglen);
+	retval = 1;
+    } else {
+        int send_flags = 0;
+#ifdef MSG_MORE
+        // if(!(flags & SW_DO_FLUSH)) send_flags |= MSG_MORE;
+#endif
+	do {
+	    int size = mesglen;
+	    if(clients[clientnr].fragment && size > clients[clientnr].fragment)
+		size = clients[clientnr].fragment;
+	    syscalls[sc_send]++;
+	    if(clients[clientnr].stdio)
+		retval = write(stdio_out, mesg, size);
+	    else
+		retval = send(clientnr, mesg, size, send_flags);
+            if(retval == -1 && errno == ENOTSOCK) {
+                retval = write(clientnr, mesg, size);
+            }
+            if(retval > 0) {
+                record_packet(clientnr, REC_OUT, mesg, retval);
+                bytes_out += retval;
+            }
+	    if(retval != mesglen) {
+		if(retval > 0) {
+		    mesglen -= retval;
+		    mesg += retval;
+		} else {
+		    /* Store it in the queue */
+		    queue_output(clientnr, mesg, mesglen);
+		}
+	    } else {
+		break;		/* We've sent it, we're done! */
+            }
+	} while(retval > 0);
+    }
+#if HAVE_ZLIB
+    if(retval > 0 && !(flags & SW_DONT_COMPRESS))
+        update_compression(clientnr);
+#endif
+    PROF_END(server_write);
+    return retval;
+}
+
+/*
+ * Like server_write, but with the data in several buffers.
+ * If nothing is queued and the output isn't compressed, all the
+ * buffers are given to the kernel with one writev() call.
+ */
+int
+server_writev(int clientnr, const struct iovec *iov, int iovcnt, int flags)
+{
+    int i, retval = 0;
+    bool direct = !clients[clientnr].writelen && !clients[clientnr].fragment &&
+                  !clients[clientnr].corked && backend != backend_io_uring;
+
+#if HAVE_ZLIB
+    /* Compression is turned on and off by server_write. */
+    if(!(flags & SW_DONT_COMPRESS) &&
+       (clients[clientnr].stream ||
+        clients[clientnr].tos_us[COMPRESS2c] == tos_YES))
+        direct = false;
+#endif
+    if(!direct) {
+        for(i = 0; i < iovcnt; i++) {
+            retval = server_write(clientnr, iov[i].iov_base, iov[i].iov_len,
+                                  i == iovcnt - 1 ? flags : (flags & SW_DONT_COMPRESS));
+        }
+        return retval;
+    }
+
+    while(iovcnt > 0) {
+        int n = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+        ssize_t sent;
+
+        syscalls[sc_send]++;
+        sent = writev(output_fd(clientnr), iov, n);
+        if(sent > 0)
+            bytes_out += sent;
+        for(i = 0; i < n; i++) {
+            size_t len = iov[i].iov_len;
+            if(sent >= 0 && (size_t)sent >= len) {
+                record_packet(clientnr, REC_OUT, iov[i].iov_base, len);
+                sent -= len;
+                continue;
+            }
+            /* The kernel didn't take it all, queue the rest. */
+            if(sent > 0) {
+                record_packet(clientnr, REC_OUT, iov[i].iov_base, sent);
+                queue_output(clientnr, (const char *)iov[i].iov_base + sent, len - sent);
+            } else {
+                queue_output(clientnr, iov[i].iov_base, len);
+            }
+            sent = 0;
+            for(i++; i < iovcnt; i++)
+                queue_output(clientnr, iov[i].iov_base, iov[i].iov_len);
+            return -1;
+        }
+        iov += n;
+        iovcnt -= n;
+        retval = 1;
+    }
+    return retval;
+}
+
+/* Returns the client's line and sets *len to its length. The line is
+ * not copied, it is valid until the next server_poll(). */
+char *
+server_read(int clientnr, int *len)
+{
+    clients[clientnr].line_ready = false;
+    if(clients[clientnr].mode & SM_QUITING)
+	return NULL;		/* Client has disconected. */
+    lines_processed++;
+    *len = clients[clientnr].line_len;
+    return clients[clientnr].line;
+}
+
+void
+server_shutdown(void)
+{
+    int i;
+    for(i = 0; i < high_fd; i++)
+        if(clients[i].is_connected)
+            server_close(i);
+    for(i = 0; i < n_listeners; i++) {
+        close(listeners[i].fd);
+        if(!strncmp(listeners[i].name, "unix:", 5))
+            unlink(listeners[i].name + 5);
+    }
+}
+
+/*
+ * ZMP messages are built in one buffer and sent with one write.
+ * zmp_length() tells how large the buffer must be and zmp_encode()
+ * puts IAC SB ZMP, the arguments with their IACs doubled and their
+ * NULs, and IAC SE in it.
+ */
+static int
+zmp_length(const char **args, int n_args)
+{
+    int i, len = 5; /* IAC SB ZMP IAC SE */
+    for(i = 0; i < n_args; i++) {
+        const char *s = args[i];
+        while(*s) {
+            if(*s == IACc) len++;
+            len++;
+            s++;
+        }
+        len++; /* For the NUL */
+    }
+    return len;
+}
+
+/* Returns the length of the message */
+static int
+zmp_encode(char *buff, const char **args, int n_args)
+{
+    char *s = buff;
+    int i;
+    *s++ = IACc;
+    *s++ = SBc;
+    *s++ = ZMPc;
+    for(i = 0; i < n_args; i++) {
+        const char *x = args[i];
+        while(*x) {
+            if(*x == IACc) *s++ = IACc;
+            *s++ = *x++;
+        }
+        *s++ = 0;
+    }
+    *s++ = IACc;
+    *s++ = SEc;
+    return s - buff;
+}
+
+/* Send a ZMP message, without any debug text.
+ * Returns -1 if there was no memory for it. */
+static int
+zmp_send(int fd, const char **args, int n_args)
+{
+    char local[256];
+    int len = zmp_length(args, n_args);
+    output_queue *block = NULL;
+    char *buff = local;
+    int retval;
+
+    /* Longer messages borrow an output block if they fit in one */
+    if(len > sizeof(local)) {
+	if(len <= BLOCK_SIZE && (block = pool_get(&block_pool)))
+	    buff = block->text;
+	else
+	    buff = malloc(len);
+    }
+    if(!buff) return -1;
+    zmp_encode(buff, args, n_args);
+    retval = server_write(fd, buff, len, 0);
+    if(block)
+	pool_put(&block_pool, block);
+    else if(buff != local)
+	free(buff);
+    return retval;
+}
+
+/* Write prefix "arg1" "arg2" ... IAC SE, in one write */
+static void
+zmp_describe(int fd, const char *prefix, const char **args, int n_args)
+{
+    struct iovec iov[3 * MAX_ZMP_ARGS + 2];
+    int i, n = 0;
+
+    iov[n].iov_base = (char *)prefix;
+    iov[n++].iov_len = strlen(prefix);
+    for(i = 0; i < n_args; i++) {
+        iov[n].iov_base = "\"";
+        iov[n++].iov_len = 1;
+        iov[n].iov_base = (char *)args[i];
+        iov[n++].iov_len = strlen(args[i]);
+        iov[n].iov_base = "\" ";
+        iov[n++].iov_len = 2;
+    }
+    iov[n].iov_base = "IAC SE\r\n";
+    iov[n++].iov_len = 8;
+    server_writev(fd, iov, n, 0);
+}
+
+void
+send_zmp(int fd, ...)
+{
+    const char *args[MAX_ZMP_ARGS];
+    int n_args = 0;
+    va_list ap;
+    char *s;
+
+    va_start(ap, fd);
+    while((s = va_arg(ap, char *)) && n_args < MAX_ZMP_ARGS)
+        args[n_args++] = s;
+    va_end(ap);
+
+    zmp_send(fd, args, n_args);
+    zmp_describe(fd, "SENT IAC SB ZMP ", args, n_args);
+}
+
+static void
+handle_zmp(int fd, char *line)
+{
+    /* split the args */
+    const char *args[MAX_ZMP_ARGS];
+    int n_args = 1;
+    args[0] = line;
+    if(!*args) {
+        simple_write(fd, "USAGE: zmp cmd [<arg>|\"<arg>\"]*\r\n");
+    }
+
+    /* split the string into commands: */
+    do {
+        if(*line == '"') {
+            args[n_args-1]++;
+            line++;
+            /* XXX have some way of excaping " characters... */
+            while(*line && *line != '"') line++;
+            if(*line != '"') {
+                simple_write(fd, "ERROR: Unterminated ZMP argument\r\n");
+                return;
+            }
+            *line++ = 0;
+        } else {
+            while(*line && *line != ' ') line++;
+            if(*line) *line++ = 0;
+        }
+        while(*line == ' ') line++;
+        if(*line) {
+            args[n_args++] = line;
+        }
+    } while(*line && n_args < MAX_ZMP_ARGS);
+
+    zmp_describe(fd, "Sending: IAC SB ZMP ", args, n_args);
+    if(zmp_send(fd, args, n_args) < 0)
+        simple_write(fd, "ERROR: failed to allocate memory for the ZMP command\r\n");
+}
+
+/*
+ * The ZMP echo benchmark. The server sends
+ *   IAC SB ZMP "mcts.echo" <sequence number> <time in ns> IAC SE
+ * at a given rate, and the client sends the same message back, so the
+ * round trip times tell how fast the client handles subnegotiations,
+ * also while it is busy with a flood.
+ */
+#ifndef ZMP_ECHO_WAIT
+#define ZMP_ECHO_WAIT 2000000000ULL	/* How long to wait for the last echoes */
+#endif
+#define ZMP_ECHO_BURST 64		/* The most pings sent at once when late */
+
+static void
+zmp_echo_report(int clinr)
+{
+    zmp_echo *ze = clients[clinr].zmp_echo;
+
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "ZMP echo: %u sent, %u echoed, round trip p50=%.1fus p99=%.1fus "
+             "p999=%.1fus max=%.1fus\r\n",
+             ze->sent, ze->echoed,
+             hist_percentile(&ze->rtt, 50) / 1e3,
+             hist_percentile(&ze->rtt, 99) / 1e3,
+             hist_percentile(&ze->rtt, 99.9) / 1e3,
+             ze->rtt.max / 1e3);
+    simple_write(clinr, debug_buffer);
+    hist_merge(&zmp_echo_rtt, &ze->rtt);
+    free(ze);
+    clients[clinr].zmp_echo = NULL;
+    set_timer(clinr, timer_zmp_echo, 0);
+}
+
+static void
+zmp_echo_timer(int clinr, uint64_t now)
+{
+    zmp_echo *ze = clients[clinr].zmp_echo;
+    int burst = 0;
+
+    if(!ze->left && !ze->forever) {
+	/* The last echoes never came */
+	zmp_echo_report(clinr);
+	server_prompt(clinr, "> ", 2);
+	return;
+    }
+    if(ze->next + 100000000 < now)
+	ze->next = now;		/* Too late, don't try to catch up */
+    while((ze->left || ze->forever) && ze->next <= now &&
+          burst++ < ZMP_ECHO_BURST) {
+	char seq[12], stamp[24];
+	const char *args[3] = { "mcts.echo", seq, stamp };
+	snprintf(seq, sizeof(seq), "%u", ze->sent++);
+	snprintf(stamp, sizeof(stamp), "%llu", (unsigned long long)now_ns());
+	zmp_send(clinr, args, 3);
+	if(!ze->forever) ze->left--;
+	ze->next += ze->interval;
+    }
+    if(ze->left || ze->forever)
+	set_timer(clinr, timer_zmp_echo, ze->next);
+    else
+	set_timer(clinr, timer_zmp_echo, now + ZMP_ECHO_WAIT);
+}
+
+/* buff is "mcts.echo" NUL <sequence number> NUL <time> NUL */
+static void
+zmp_echo_received(int clinr, const char *buff, int len)
+{
+    zmp_echo *ze = clients[clinr].zmp_echo;
+    const char *stamp;
+    uint64_t sent, now = now_ns();
+
+    if(!ze || buff[len - 1])
+	return;			/* Not running, or not NUL terminated */
+    stamp = buff + 10;
+    stamp += strlen(stamp) + 1;
+    if(stamp >= buff + len)
+	return;
+    sent = strtoull(stamp, NULL, 10);
+    if(!sent || sent > now)
+	return;			/* A garbled stamp, it is not ours */
+    hist_add(&ze->rtt, now - sent);
+    if(++ze->echoed == ze->sent && !ze->left && !ze->forever) {
+	zmp_echo_report(clinr);
+	server_prompt(clinr, "> ", 2);
+    }
+}
+
+static void
+handle_zmpecho(int fd, const char *args)
+{
+    double rate = atof(args);
+    long count = 0;
+    zmp_echo *ze;
+
+    if(!strcasecmp(args, "stop")) {
+	if(clients[fd].zmp_echo)
+	    zmp_echo_report(fd);
+	return;
+    }
+    while(*args && *args != ' ') args++;
+    if(*args) count = atol(args);
+    if(rate <= 0 || count < 0) {
+	simple_write(fd, "Usage: zmpecho <pings per second> [<count>]\r\n"
+	                 "       zmpecho stop\r\n");
+	return;
+    }
+    if(clients[fd].tos_us[ZMPc] != tos_YES) {
+	simple_write(fd, "ZMP is not turned on.\r\n");
+	return;
+    }
+    if(clients[fd].zmp_echo)
+	zmp_echo_report(fd);
+    ze = calloc(1, sizeof(zmp_echo));
+    ze->interval = 1e9 / rate;
+    if(!ze->interval) ze->interval = 1;
+    ze->next = now_ns();
+    ze->left = count;
+    ze->forever = !count;
+    clients[fd].zmp_echo = ze;
+    set_timer(fd, timer_zmp_echo, ze->next);
+}
+
+/* The colourshow and colourshow256 tables never change, so they are
+ * made once by make_colour_blobs() and sent with one write. */
+typedef struct blob {
+    char data[16384];
+    int len;
+} blob;
+
+static blob colour_blob, colour256_blob;
+
+static void
+blob_printf(blob *b, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    b->len += vsnprintf(b->data + b->len, sizeof(b->data) - b->len, fmt, ap);
+    va_end(ap);
+    if(b->len > sizeof(b->data))
+	b->len = sizeof(b->data);
+}
+
+static void
+make_colour_show(blob *b)
+{
+    int bg;
+    const char cols[] = "nrgybmcwNRGYBMCW";
+    blob_printf(b, "These are the colours:\r\n  n  r  g  y  b  m  c  w  "
+            "N  R  G  Y  B  M  C  W\r\n");
+    for(bg = 0; bg < 8; bg++) {
+        int bold;
+        blob_printf(b, "%c ", cols[bg]);
+        for(bold = 0; bold < 2; bold++) {
+            int f;
+            for(f = 0; f < 8; f++) {
+                if(bold) {
+                    blob_printf(b, "\e[1;3%d;4%dm%c%c \033[0m", f, bg, cols[f+8], cols[bg]);
+                } else {
+                    blob_printf(b, "\e[0;3%d;4%dm%c%c \033[0m", f, bg, cols[f], cols[bg]);
+                }
+            }
+        }
+        blob_printf(b, "\r\n");
+    }
+}
+
+static void
+make_colour_show256(blob *bl)
+{
+    int c, i, j, r, g, b;
+    const char cols[] = "nrgybmcwNRGYBMCW";
+    const char rgb[] = "012345";
+
+    blob_printf(bl, "Basic colours:  ");
+    for(i = 0; i < 8; i++)
+        blob_printf(bl, "\033[3%dm%c", i, cols[i]);
+    blob_printf(bl, " ");
+    for(i = 0; i < 8; i++)
+        blob_printf(bl, "\033[4%dm%c", i, cols[i]);
+    blob_printf(bl, "\033[0m\r\nBright colours: \033[1m");
+    for(i = 0; i < 8; i++)
+        blob_printf(bl, "\033[3%dm%c", i, cols[i+8]);
+    blob_printf(bl, " ");
+
+    for(i = 0; i < 8; i++)
+        blob_printf(bl, "\033[4%dm%c", i, cols[i]);
+    blob_printf(bl, "\033[0m\r\n\r\n6x6x6 colour cubes:\r\n  R");
+
+    for(i = 0; i < 6; i++)
+        blob_printf(bl, "%s", rgb);
+    blob_printf(bl, " ");
+
+    for(i = 0; i < 6; i++)
+        blob_printf(bl, "%s", rgb);
+    
+    blob_printf(bl, "\r\n  G");
+
+    for(c = 0; c < 2; c++) {
+        if(c == 1) blob_printf(bl, " ");
+        for(i = 0; i < 6; i++)
+            for(j = 0; j < 6; j++)
+                blob_printf(bl, "%d", i);
+    }
+    blob_printf(bl, "\r\n");
+    for(b = 0; b < 6; b++) {
+        blob_printf(bl, "B%d ", b);
+        for(g = 0; g < 6; g++) {
+            for(r = 0; r < 6; r++)
+                blob_printf(bl, "\033[38;5;%dmX", 16+r*36+g*6+b);
+        }
+        blob_printf(bl, "\033[0m ");
+        for(g = 0; g < 6; g++) {
+            for(r = 0; r < 6; r++)
+                blob_printf(bl, "\033[48;5;%dmX", 16+r*36+g*6+b);
+        }
+        blob_printf(bl, "\033[0m\r\n");
+    }
+
+    blob_printf(bl, "\r\nGreyscales (0-23): ");
+
+    for(i = 0; i < 24; i++)
+        blob_printf(bl, "\033[38;5;%dmX", 16+6*6*6+i);
+    blob_printf(bl, " ");
+    for(i = 0; i < 24; i++)
+        blob_printf(bl, "\033[48;5;%dmX", 16+6*6*6+i);
+    blob_printf(bl, "\033[0m\r\n");
+}
+
+static void
+make_colour_blobs(void)
+{
+    make_colour_show(&colour_blob);
+    make_colour_show256(&colour256_blob);
+}
+
+static void
+colour_show(int fd)
+{
+    server_write(fd, colour_blob.data, colour_blob.len, 0);
+}
+
+static void
+colour_show256(int fd)
+{
+    server_write(fd, colour256_blob.data, colour256_blob.len, 0);
+}
+
+static void
+send_data(int fd, char *line)
+{
+    char *s;
+    if(!*line) {
+        simple_write(fd, "USAGE: senddata <hex byte> <hex byte>*\r\nExample: senddata 41 42 43  -- sends ABC\r\n");
+        return;
+    }
+    while((s = strtok(line, " "))) {
+        int x;
+        line = 0;
+        if(sscanf(s, "%x", &x) != 1 || x > 255 || x < 0) {
+            simple_write(fd, "\r\nERROR: Unknown byte.\r\n");
+            return;
+        } else {
+            char c = (char)x;
+            server_write(fd, &c, 1, 0);
+        }
+    }
+    simple_write(fd, "\r\n");
+}
+
+/* Some variables change how the server treats the client */
+/*
+ * Idle clients. A client that has sent nothing for idle_timeout seconds
+ * is closed, unless a flood or a zmpecho is running for it. The input
+ * only updates last_input, the timer moves itself when it goes off.
+ */
+static void
+idle_timer(int clinr, uint64_t now)
+{
+    uint64_t idle = clients[clinr].idle_timeout * 1000000000ULL;
+
+    if(!idle)
+	return;
+    if(clients[clinr].last_input + idle > now) {
+	set_timer(clinr, timer_idle, clients[clinr].last_input + idle);
+    } else if(clients[clinr].producer || clients[clinr].zmp_echo ||
+              clients[clinr].tilestorm) {
+	set_timer(clinr, timer_idle, now + idle);
+    } else if(clients[clinr].http) {
+	clients[clinr].mode |= SM_QUITING;
+    } else {
+	simple_write(clinr, "\r\nYou have been idle for too long, bye!\r\n");
+	clients[clinr].mode |= SM_QUITING;
+	idle_reaped++;
+    }
+}
+
+/* Send IAC NOP to a client that has been quiet, so a connection to a
+ * host that is gone gets an error instead of keeping its slot */
+static void
+keepalive_timer(int clinr, uint64_t now)
+{
+    static const char nop[] = { IACc, '\361' };
+    uint64_t interval = keepalive_interval * 1000000000ULL;
+
+    if(clients[clinr].last_input + interval <= now && !clients[clinr].writelen) {
+	server_write(clinr, nop, sizeof(nop), 0);
+	keepalives_sent++;
+    }
+    set_timer(clinr, timer_keepalive, now + interval);
+}
+
+static void
+var_changed(int fd, const char *key, const char *value)
+{
+    int option;
+    if(!strcmp(key, "fragment")) {
+	int n = value ? atoi(value) : 0;
+	clients[fd].fragment = n > 0 && n < 65536 ? n : 0;
+    } else if(!strcmp(key, "highwater")) {
+	clients[fd].high_water = value ? parse_size(value) : default_high_water;
+    } else if(!strcmp(key, "idle")) {
+	clients[fd].idle_timeout = value ? atoi(value) : default_idle_timeout;
+	if(clients[fd].idle_timeout < 0)
+	    clients[fd].idle_timeout = 0;
+	set_timer(fd, timer_idle, clients[fd].idle_timeout ?
+	          clients[fd].last_input + clients[fd].idle_timeout * 1000000000ULL : 0);
+    } else if(!strcmp(key, "lowwater")) {
+	clients[fd].low_water = value ? parse_size(value) : default_low_water;
+    } else if(!strcmp(key, "dropat")) {
+	clients[fd].drop_at = value ? parse_size(value) : default_drop_at;
+    } else if((option = find_tcp_option(key)) >= 0) {
+	int n = value ? (int)parse_size(value) : listeners[clients[fd].listener].tcp[option];
+	if(option == tcp_quickack)
+	    clients[fd].quickack = n > 0;
+	if(n < 0) {
+	    /* Back to Nagle and no low water mark. The buffers can not be
+	     * given back to the autotuning, and quickack just isn't set. */
+	    if(option != tcp_nodelay && option != tcp_notsent_lowat)
+		return;
+	    n = 0;
+	}
+	if(!set_tcp_option(fd, option, n)) {
+	    snprintf(debug_buffer, sizeof(debug_buffer), "Could not set %s: %s\r\n",
+	             key, strerror(errno));
+	    simple_write(fd, debug_buffer);
+	}
+    }
+}
+
+/* Writes the TCP options the client's socket has now */
+static void
+show_tcp_options(int fd)
+{
+    int i;
+    simple_write(fd, "TCP options:");
+    for(i = 0; i < tcp_count; i++) {
+	int value = 0;
+	socklen_t len = sizeof(value);
+	if(i == tcp_quickack) {
+	    value = clients[fd].quickack;
+	} else {
+	    syscalls[sc_sockopt]++;
+	    getsockopt(fd, tcp_options[i].level, tcp_options[i].option, &value, &len);
+	}
+	snprintf(debug_buffer, sizeof(debug_buffer), " %s %d", tcp_options[i].name, value);
+	simple_write(fd, debug_buffer);
+    }
+    simple_write(fd, "\r\n");
+}
+
+static void
+set_var(int fd, const char *key, const char *value)
+{
+    var_changed(fd, key, value);
+    key_value *curr = clients[fd].variables;
+    while(curr) {
+	if(!strcmp(curr->key, key)) {
+	    // Update.
+	    pool_strfree(curr->value);
+	    curr->value = pool_strdup(value);
+	    return;
+	}
+	curr = curr->next;
+    }
+    // New value.
+    curr = pool_get(&var_pool);
+    curr->next = clients[fd].variables;
+    curr->key = pool_strdup(key);
+    curr->value = pool_strdup(value);
+    clients[fd].variables = curr;
+}
+
+static void
+remove_var(int fd, const char *key)
+{
+    var_changed(fd, key, NULL);
+    key_value *last = clients[fd].variables;
+    if(!last) return;
+    if(!strcmp(last->key, key)) {
+	clients[fd].variables = last->next;
+	pool_strfree(last->key);
+	pool_strfree(last->value);
+	pool_put(&var_pool, last);
+	return;
+    }
+    while(last->next) {
+	key_value *curr = last->next;
+	if(!strcmp(curr->key, key)) {
+	    last->next = curr->next;
+	    pool_strfree(curr->key);
+	    pool_strfree(curr->value);
+	    pool_put(&var_pool, curr);
+	    return;
+	}
+	last = last->next;
+    }
+}
+
+static void
+handle_set(int fd, char *args)
+{
+    if(!*args) {
+	key_value *curr = clients[fd].variables;
+	if(!curr) {
+	    simple_write(fd, "No variables are set.\r\n"
+		    "Use \"set var value\" to set the \"var\" variable to \"value\".\r\n"
+		    "Use \"set var\" to unset the \"var\" variable.\r\n"
+		    "Known variables are:\r\n"
+		    "  nodebug - if set to any value, stops telnet options from being displayed.\r\n"
+		    "  fragment - send the output in pieces of at most this many bytes.\r\n"
+		    "  highwater - pause floods and such when this much output is queued.\r\n"
+		    "  lowwater - resume them when the queue is this short.\r\n"
+		    "  dropat - disconnect when this much output is queued.\r\n"
+		    "  idle - disconnect after this many seconds without input, 0 = never.\r\n"
+		    "  nodelay - 1 turns off Nagle's algorithm, 0 turns it on.\r\n"
+		    "  quickack - 1 acknowledges all input at once, 0 delays the ACKs.\r\n"
+		    "  sndbuf, rcvbuf - the socket's send and receive buffer sizes.\r\n"
+		    "  notsentlowat - queue output here instead of in the socket when\r\n"
+		    "    this much is not sent yet, 0 = the system's default.\r\n"
+		    );
+	} else {
+	    while(curr) {
+		sprintf(debug_buffer, "%s=%s\r\n", curr->key, curr->value);
+		simple_write(fd, debug_buffer);
+		curr = curr->next;
+	    }
+	}
+	show_tcp_options(fd);
+    } else {
+	char *key = args;
+	char *value = NULL;
+	while(*args++) {
+	    if(*args == ' ') {
+		*args = 0;
+		value = args+1;
+		break;
+	    }
+	}
+	if(value && !*value) value = NULL;
+
+	if(value) {
+	    set_var(fd, key, value);
+	} else {
+	    remove_var(fd, key);
+	}
+    }
+}
+
+/*
+ * Test scenarios.
+ *
+ * The scenario file (scenarios.txt, see that file for its format) is
+ * parsed once when the server starts. Each scenario is turned into
+ * steps, where the data steps point into the scenario's data with an
+ * iovec array. A repeated part is only stored once, its iovecs are
+ * repeated instead, so large floods take little memory and each data
+ * step is sent with a few writev() calls.
+ */
+typedef enum step_type {
+    step_data,
+    step_prompt,
+    step_delay
+} step_type;
+
+typedef struct scenario_step {
+    step_type type;
+    int delay;			/* In ms, for step_delay */
+    struct iovec *iov;		/* The data, for step_data and step_prompt */
+    int iovcnt;
+} scenario_step;
+
+typedef struct scenario {
+    struct scenario *next;
+    char *command;
+    char *args;
+    char *description;
+    char *data;			/* All the bytes, the steps' iovecs point here */
+    size_t len;
+    scenario_step *steps;
+    int n_steps;
+} scenario;
+
+/* The max number of nested @repeat */
+#define MAX_REPEAT_DEPTH 4
+
+typedef struct scenario_parser {
+    scenario *sc;
+    size_t size;		/* The allocated size of sc->data */
+    bool new_segment;		/* The next data must start a new iovec */
+    int depth;
+    int repeat_count[MAX_REPEAT_DEPTH];
+    int repeat_start[MAX_REPEAT_DEPTH];	/* The first iovec to repeat */
+} scenario_parser;
+
+static scenario *scenarios;
+
+static scenario_step *
+add_step(scenario *sc, step_type type)
 {
-    int retval = 0;
+    scenario_step *step;
+    sc->steps = realloc(sc->steps, (sc->n_steps + 1) * sizeof(scenario_step));
+    step = &sc->steps[sc->n_steps++];
+    memset(step, 0, sizeof(*step));
+    step->type = type;
+    return step;
+}
 
-#if HAVE_ZLIB
+/* Until the scenario is complete, iov_base holds an offset into
+ * sc->data, since it may be moved by realloc. */
+static void
+add_segment(scenario_step *step, size_t offset, size_t len)
+{
+    step->iov = realloc(step->iov, (step->iovcnt + 1) * sizeof(struct iovec));
+    step->iov[step->iovcnt].iov_base = (void *)offset;
+    step->iov[step->iovcnt].iov_len = len;
+    step->iovcnt++;
+}
 
-    if(!(flags & SW_DONT_COMPRESS) && clients[clientnr].stream) {
-        z_stream *stream = clients[clientnr].stream;
+/* Append the bytes to sc->data, returns their offset in it */
+static size_t
+add_bytes(scenario_parser *p, const char *data, size_t len)
+{
+    scenario *sc = p->sc;
+    size_t offset = sc->len;
 
-        stream->next_in = (Bytef*)mesg;
-        stream->avail_in = mesglen;
+    if(sc->len + len > p->size) {
+        while(sc->len + len > p->size)
+            p->size = p->size ? p->size * 2 : 1024;
+        sc->data = realloc(sc->data, p->size);
+    }
+    memcpy(sc->data + sc->len, data, len);
+    sc->len += len;
+    return offset;
+}
 
-        while((flags & (SW_FINISH|SW_DO_FLUSH)) ||
-               stream->avail_in ||
-               stream->avail_out != COMP_BUFF_LEN) {
+static void
+add_data(scenario_parser *p, const char *data, size_t len)
+{
+    scenario *sc = p->sc;
+    scenario_step *step = sc->n_steps ? &sc->steps[sc->n_steps - 1] : NULL;
+    size_t offset;
 
-            if(!(flags & (SW_DO_FLUSH|SW_FINISH)) &&
-               !stream->avail_in &&
-               stream->avail_out == COMP_BUFF_LEN)
-                return retval;
+    if(!len) return;
+    offset = add_bytes(p, data, len);
 
-            int z_flag = Z_NO_FLUSH;
-            if(flags & SW_FINISH) {
-                z_flag = Z_FINISH;
-            } else if(flags & SW_DO_FLUSH) {
-                z_flag = Z_SYNC_FLUSH;
-            }
-            switch(deflate(stream, z_flag)) {
-                case Z_BUF_ERROR:
-                    /* sprintf(debug_buffer, "Got Z_BUF_ERROR %d:%d %s\r\n", stream->avail_in, COMP_BUFF_LEN - stream->avail_out, stream->msg);
-                    simple_write(clientnr, debug_buffer); */
-                    return retval;
-                case Z_STREAM_END:
-                     clients[clientnr].stream = NULL;
-                case Z_OK:
-                    if(COMP_BUFF_LEN != stream->avail_out) {
-                        retval = server_write(clientnr,
-                                              (char*)clients[clientnr].comp_buffer,
-                                              COMP_BUFF_LEN - stream->avail_out,
-                                              SW_DONT_COMPRESS);
-                        stream->next_out = clients[clientnr].comp_buffer;
-                        stream->avail_out = COMP_BUFF_LEN;
+    if(!step || step->type != step_data) {
+        step = add_step(sc, step_data);
+        p->new_segment = true;
+    }
+    if(p->new_segment || !step->iovcnt) {
+        add_segment(step, offset, len);
+        p->new_segment = false;
+    } else {
+        step->iov[step->iovcnt - 1].iov_len += len;
+    }
+}
+
+/* Parse a "quoted" string with C escapes. The result is put in out,
+ * and *sp is moved past the string. Returns the length, or -1. */
+static int
+parse_quoted(const char **sp, char *out, int size)
+{
+    const char *s = *sp + 1;
+    int len = 0;
+
+    while(*s && *s != '"') {
+        int c = (unsigned char)*s++;
+        if(c == '\\') {
+            c = (unsigned char)*s++;
+            switch(c) {
+                case 'e': c = '\033'; break;
+                case 'r': c = '\r'; break;
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'a': c = '\a'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'v': c = '\v'; break;
+                case 'x':
+                    {
+                        int i, x = 0;
+                        for(i = 0; i < 2 && isxdigit((unsigned char)*s); i++, s++)
+                            x = x * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (tolower((unsigned char)*s) - 'a' + 10));
+                        if(!i) return -1;
+                        c = x;
                     }
-                    if(!clients[clientnr].stream) {
-                        sprintf(debug_buffer, "CompStatistics: in: %ld, out %ld %.1f%%\r\n", 
-                                    stream->total_in,
-                                    stream->total_out,
-                                    100.0*(float)stream->total_out /
-                                                 stream->total_in);
-                        deflateEnd(stream);
-                        free(stream);
-                        free(clients[clientnr].comp_buffer);
-                        clients[clientnr].comp_buffer = NULL;
-                        simple_write(clientnr, debug_buffer);
-                        return retval;
+                    break;
+                case '0': case '1': case '2': case '3':
+                case '4': case '5': case '6': case '7':
+                    {
+                        int i, x = c - '0';
+                        for(i = 1; i < 3 && *s >= '0' && *s <= '7'; i++, s++)
+                            x = x * 8 + (*s - '0');
+                        c = x & 255;
                     }
                     break;
-                case Z_STREAM_ERROR:
+                case 0:
+                    return -1;
                 default:
-                    fprintf(stderr, "Something went bad with compression: %s\n", stream->msg);
-                    deflateEnd(stream);
-                    free(stream);
-                    free(clients[clientnr].comp_buffer);
-                    clients[clientnr].comp_buffer = NULL;
-                    clients[clientnr].stream = NULL;
-                    return retval;
+                    /* \\ \" \' and such */
+                    break;
             }
         }
-        return retval;
+        if(len == size) return -1;
+        out[len++] = c;
+    }
+    if(*s != '"') return -1;
+    *sp = s + 1;
+    return len;
+}
+
+/* Fix the iovecs' pointers and add the scenario to the list */
+static void
+finish_scenario(scenario_parser *p, const char *filename, int line_nr)
+{
+    scenario *sc = p->sc;
+    int i, j;
+
+    if(!sc) return;
+    if(p->depth) {
+        fprintf(stderr, "%s:%d: missing @end in [%s %s]\n",
+                filename, line_nr, sc->command, sc->args);
+    }
+    for(i = 0; i < sc->n_steps; i++) {
+        for(j = 0; j < sc->steps[i].iovcnt; j++) {
+            struct iovec *iov = &sc->steps[i].iov[j];
+            iov->iov_base = sc->data + (size_t)iov->iov_base;
+        }
+    }
+    {
+        scenario **last = &scenarios;
+        while(*last)
+            last = &(*last)->next;
+        *last = sc;
+    }
+    p->sc = NULL;
+}
+
+static bool
+parse_scenario_line(scenario_parser *p, const char *s, const char *filename, int line_nr)
+{
+    static char buff[SCENARIO_LINE_LEN];
+    scenario *sc = p->sc;
+
+    if(*s == '[') {
+        const char *end = strchr(s, ']');
+        const char *args;
+        if(!end) return false;
+        finish_scenario(p, filename, line_nr);
+        sc = p->sc = calloc(1, sizeof(scenario));
+        p->size = 0;
+        p->depth = 0;
+        s++;
+        while(*s == ' ') s++;
+        args = s;
+        while(args < end && *args != ' ') args++;
+        sc->command = strndup(s, args - s);
+        while(args < end && *args == ' ') args++;
+        while(end > args && end[-1] == ' ') end--;
+        sc->args = strndup(args, end - args);
+        s = strchr(s, ']') + 1;
+        while(*s == ' ') s++;
+        sc->description = strdup(s);
+        sc->description[strcspn(sc->description, "\r\n")] = 0;
+        return true;
+    }
+    if(!sc) return false;
+
+    if(*s == '"') {
+        while(*s == '"') {
+            int len = parse_quoted(&s, buff, sizeof(buff));
+            if(len < 0) return false;
+            add_data(p, buff, len);
+            while(*s == ' ' || *s == '\t') s++;
+        }
+        return !*s || *s == '#' || *s == '\r' || *s == '\n';
+    }
+    if(!strncmp(s, "@delay ", 7)) {
+        if(p->depth) return false;
+        add_step(sc, step_delay)->delay = atoi(s + 7);
+        return true;
+    }
+    if(!strncmp(s, "@prompt ", 8)) {
+        int len;
+        s += 8;
+        while(*s == ' ') s++;
+        if(p->depth || *s != '"') return false;
+        len = parse_quoted(&s, buff, 80);
+        if(len < 1) return false;
+        /* A step of its own, the data after it starts a new one */
+        add_segment(add_step(sc, step_prompt), add_bytes(p, buff, len), len);
+        return true;
+    }
+    if(!strncmp(s, "@repeat ", 8)) {
+        scenario_step *step;
+        if(p->depth == MAX_REPEAT_DEPTH) return false;
+        step = sc->n_steps ? &sc->steps[sc->n_steps - 1] : NULL;
+        if(!step || step->type != step_data)
+            step = add_step(sc, step_data);
+        p->repeat_count[p->depth] = atoi(s + 8);
+        p->repeat_start[p->depth] = step->iovcnt;
+        p->depth++;
+        p->new_segment = true;
+        return true;
+    }
+    if(!strncmp(s, "@end", 4)) {
+        scenario_step *step = sc->n_steps ? &sc->steps[sc->n_steps - 1] : NULL;
+        int start, end, n;
+        if(!p->depth || !step || step->type != step_data) return false;
+        p->depth--;
+        start = p->repeat_start[p->depth];
+        end = step->iovcnt;
+        for(n = 1; n < p->repeat_count[p->depth]; n++) {
+            int i;
+            for(i = start; i < end; i++)
+                add_segment(step, (size_t)step->iov[i].iov_base, step->iov[i].iov_len);
+        }
+        if(p->repeat_count[p->depth] < 1)
+            step->iovcnt = start;
+        p->new_segment = true;
+        return true;
+    }
+    return false;
+}
+
+static bool
+load_scenarios(const char *filename)
+{
+    char line[SCENARIO_LINE_LEN];
+    scenario_parser parser;
+    int line_nr = 0;
+    FILE *f = fopen(filename, "r");
+
+    if(!f) return false;
+    memset(&parser, 0, sizeof(parser));
+    while(fgets(line, sizeof(line), f)) {
+        const char *s = line;
+        line_nr++;
+        while(*s == ' ' || *s == '\t') s++;
+        if(!*s || *s == '#' || *s == '\r' || *s == '\n') continue;
+        if(!parse_scenario_line(&parser, s, filename, line_nr)) {
+            fprintf(stderr, "%s:%d: syntax error: %s", filename, line_nr, line);
+        }
+    }
+    finish_scenario(&parser, filename, line_nr);
+    fclose(f);
+    return true;
+}
+
+static void
+sleep_ms(int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/* Where a scenario that is being sent is */
+typedef struct scenario_run {
+    const scenario *sc;
+    int step;
+    int iov;			/* The step's next iovec */
+    size_t offset;		/* The number of bytes of it that are sent */
+} scenario_run;
+
+/* Sends about PRODUCER_CHUNK bytes of the scenario */
+static bool
+scenario_producer(int fd)
+{
+    scenario_run *run = clients[fd].producer_data;
+    struct iovec iov[IOV_MAX];
+    size_t len = 0;
+    int n = 0;
+
+    while(run->step < run->sc->n_steps) {
+        const scenario_step *step = &run->sc->steps[run->step];
+        switch(step->type) {
+            case step_data:
+                while(run->iov < step->iovcnt && n < IOV_MAX && len < PRODUCER_CHUNK) {
+                    size_t size = step->iov[run->iov].iov_len - run->offset;
+                    if(size > PRODUCER_CHUNK - len)
+                        size = PRODUCER_CHUNK - len;
+                    iov[n].iov_base = (char *)step->iov[run->iov].iov_base + run->offset;
+                    iov[n].iov_len = size;
+                    n++;
+                    len += size;
+                    run->offset += size;
+                    if(run->offset == step->iov[run->iov].iov_len) {
+                        run->iov++;
+                        run->offset = 0;
+                    }
+                }
+                if(run->iov == step->iovcnt) {
+                    run->step++;
+                    run->iov = 0;
+                }
+                server_writev(fd, iov, n, 0);
+                return true;
+            case step_prompt:
+                server_prompt(fd, step->iov[0].iov_base, step->iov[0].iov_len);
+                break;
+            case step_delay:
+                server_flush(fd);
+                sleep_ms(step->delay);
+                break;
+        }
+        run->step++;
+    }
+    return false;
+}
+
+/* The scenario is sent by a producer, as it may be larger than DROP_AT */
+static void
+run_scenario(int fd, const scenario *sc)
+{
+    scenario_run *run = calloc(1, sizeof(scenario_run));
+    run->sc = sc;
+    start_producer(fd, scenario_producer, run, NULL);
+}
+
+/*
+ * Run the scenario for "command args". If there is none, the command's
+ * scenario without arguments is run, or a list of its scenarios is sent.
+ * Returns false if there are no scenarios for the command at all.
+ */
+static bool
+run_scenario_command(int fd, const char *command, const char *args)
+{
+    const scenario *sc, *fallback = NULL;
+    bool found = false;
+
+    for(sc = scenarios; sc; sc = sc->next) {
+        if(strcasecmp(sc->command, command)) continue;
+        found = true;
+        if(!strcmp(sc->args, args)) {
+            run_scenario(fd, sc);
+            return true;
+        }
+        if(!*sc->args) fallback = sc;
+    }
+    if(!found) return false;
+    if(fallback) {
+        run_scenario(fd, fallback);
+    } else {
+        for(sc = scenarios; sc; sc = sc->next) {
+            if(strcasecmp(sc->command, command)) continue;
+            snprintf(debug_buffer, sizeof(debug_buffer), "%s %s - %s\r\n",
+                     sc->command, sc->args, sc->description);
+            simple_write(fd, debug_buffer);
+        }
+    }
+    return true;
+}
+
+static uint32_t flood_seed = 4711;
+
+/*
+ * Output that depends on the client's screen size (flood, tilestorm
+ * and the word wrapping test) is made the first time a size is asked
+ * for and is kept, so the clients with the same size share it. The
+ * renderings are kept in least recently used order and the unused
+ * ones are freed when they take more than RENDER_CACHE_SIZE bytes.
+ */
+#ifndef RENDER_CACHE_SIZE
+#define RENDER_CACHE_SIZE (16 * 1024 * 1024)
+#endif
+
+/* The screen size that is used when the client has not sent NAWS,
+ * and the sizes that output is made for. */
+#define DEFAULT_WIDTH 80
+#define DEFAULT_HEIGHT 24
+#define MIN_WIDTH 20
+#define MAX_WIDTH 250
+#define MIN_HEIGHT 8
+#define MAX_HEIGHT 100
+
+enum { render_flood, render_tilestorm, render_wrap_test, render_count };
+
+typedef struct rendering {
+    struct rendering *next;
+    int kind;
+    int arg;			/* The flood pattern, the tilestorm's percent */
+    int width, height;
+    char *data;
+    size_t len;
+    size_t *frame;		/* Where the frames start, for tilestorm */
+    int frames;
+    int users;			/* The clients that are sending it */
+} rendering;
+
+static void make_flood(rendering *r);
+static void make_tilestorm(rendering *r);
+static void make_wrap_test(rendering *r);
+
+static void (*const render_makers[render_count])(rendering *r) = {
+    make_flood,
+    make_tilestorm,
+    make_wrap_test,
+};
+static rendering *renderings;
+static size_t rendering_bytes;
+static uint64_t rendering_hits, rendering_misses;
+
+/* The client's screen size, from NAWS, or 80x24 */
+static void
+screen_size(int clinr, int *width, int *height)
+{
+    *width = clients[clinr].x_size ? clients[clinr].x_size : DEFAULT_WIDTH;
+    *height = clients[clinr].y_size ? clients[clinr].y_size : DEFAULT_HEIGHT;
+    if(*width < MIN_WIDTH) *width = MIN_WIDTH;
+    if(*width > MAX_WIDTH) *width = MAX_WIDTH;
+    if(*height < MIN_HEIGHT) *height = MIN_HEIGHT;
+    if(*height > MAX_HEIGHT) *height = MAX_HEIGHT;
+}
+
+static size_t
+rendering_size(const rendering *r)
+{
+    return sizeof(rendering) + r->len + r->frames * sizeof(size_t);
+}
+
+/* Free the least recently used renderings that nobody is sending */
+static void
+trim_renderings(void)
+{
+    while(rendering_bytes > RENDER_CACHE_SIZE) {
+	rendering **rp, **last = NULL, *r;
+	for(rp = &renderings; *rp; rp = &(*rp)->next) {
+	    if(!(*rp)->users) last = rp;
+	}
+	if(!last)
+	    return;
+	r = *last;
+	*last = r->next;
+	rendering_bytes -= rendering_size(r);
+	free(r->data);
+	free(r->frame);
+	free(r);
+    }
+}
+
+/* The output of the kind for the size, it is made if it is not kept.
+ * Give it back with put_rendering() when it is sent. */
+static rendering *
+get_rendering(int kind, int arg, int width, int height)
+{
+    rendering **rp, *r;
+
+    for(rp = &renderings; (r = *rp); rp = &r->next) {
+	if(r->kind == kind && r->arg == arg &&
+	   r->width == width && r->height == height) {
+	    *rp = r->next;
+	    break;
+	}
+    }
+    if(r) {
+	rendering_hits++;
+    } else {
+	rendering_misses++;
+	r = calloc(1, sizeof(rendering));
+	r->kind = kind;
+	r->arg = arg;
+	r->width = width;
+	r->height = height;
+	flood_seed = 4711;	/* The same output every time */
+	render_makers[kind](r);
+	rendering_bytes += rendering_size(r);
+    }
+    r->next = renderings;
+    renderings = r;
+    r->users++;
+    trim_renderings();
+    return r;
+}
+
+static void
+put_rendering(rendering *r)
+{
+    r->users--;
+}
+
+/*
+ * The flood command's output is cut from precomputed buffers, so the
+ * server can send it as fast as the client reads it. Every buffer is
+ * made of lines, or frames, as wide as the client's screen, that end
+ * with a newline.
+ */
+#ifndef FLOOD_BUFF_LEN
+#define FLOOD_BUFF_LEN (64 * 1024)
+#endif
+
+/* Sent after the flood, to leave the terminal in a sane state */
+#define FLOOD_RESET "\e[0m\e[r\e[%d;1H\r\n"
+
+typedef struct flood_pattern {
+    const char *name;
+    const char *description;
+    void (*line)(char *out, size_t *len, int columns, int rows);
+} flood_pattern;
+
+typedef struct flood_run {
+    rendering *r;
+    uint64_t left;		/* Bytes left to send */
+    uint64_t sent;
+    size_t offset;		/* In the rendering's data */
+    uint64_t start;
+} flood_run;
+
+/* A small xorshift generator, so the output is the same every time */
+static uint32_t
+flood_random(uint32_t max)
+{
+    flood_seed ^= flood_seed << 13;
+    flood_seed ^= flood_seed >> 17;
+    flood_seed ^= flood_seed << 5;
+    return flood_seed % max;
+}
+
+static void
+flood_words(char *out, size_t *len, int columns)
+{
+    static const char *words[] = {
+        "the", "orc", "hits", "you", "with", "a", "rusty", "sword",
+        "gold", "coins", "north", "dragon", "breathes", "fire", "and",
+        "misses", "potion", "scroll", "of", "identify", "tavern", "ale"
+    };
+    int col = 0;
+    while(col < columns) {
+        const char *w = words[flood_random(sizeof(words) / sizeof(words[0]))];
+        int wlen = strlen(w);
+        if(col + wlen + 1 > columns) break;
+        *len += sprintf(out + *len, "%s ", w);
+        col += wlen + 1;
+    }
+}
+
+static void
+flood_line_text(char *out, size_t *len, int columns, int rows)
+{
+    flood_words(out, len, columns);
+}
+
+static void
+flood_line_sgr(char *out, size_t *len, int columns, int rows)
+{
+    int col = 0;
+    while(col < columns - 8) {
+        int n = 3 + flood_random(6);
+        *len += sprintf(out + *len, "\e[%d;%dm", flood_random(2), 30 + flood_random(8));
+        while(n--) out[(*len)++] = 'a' + flood_random(26);
+        col += 8;
+        *len += sprintf(out + *len, "\e[0m ");
+        while(col % 8) { out[(*len)++] = ' '; col++; }
+    }
+}
+
+static void
+flood_line_256(char *out, size_t *len, int columns, int rows)
+{
+    int col;
+    for(col = 0; col < columns; col++) {
+        *len += sprintf(out + *len, "\e[38;5;%d;48;5;%dm%c",
+                        flood_random(256), flood_random(256),
+                        'A' + flood_random(26));
+    }
+    *len += sprintf(out + *len, "\e[0m");
+}
+
+static void
+flood_line_cursor(char *out, size_t *len, int columns, int rows)
+{
+    int i;
+    for(i = 0; i < 20; i++) {
+        *len += sprintf(out + *len, "\e[%d;%dH%c",
+                        1 + flood_random(rows), 1 + flood_random(columns),
+                        '!' + flood_random(94));
+    }
+    *len += sprintf(out + *len, "\e[%d;1H", rows);
+}
+
+static void
+flood_line_scroll(char *out, size_t *len, int columns, int rows)
+{
+    int top = 1 + flood_random(rows / 2 - 2);
+    int bottom = top + 2 + flood_random(rows - top - 2);
+    switch(flood_random(3)) {
+        case 0:
+            /* Scroll up at the bottom of the region */
+            *len += sprintf(out + *len, "\e[%d;%dr\e[%d;1H", top, bottom, bottom);
+            break;
+        case 1:
+            /* Reverse index at the top of the region */
+            *len += sprintf(out + *len, "\e[%d;%dr\e[%d;1H\eM", top, bottom, top);
+            break;
+        default:
+            /* Insert and delete lines */
+            *len += sprintf(out + *len, "\e[%d;%dr\e[%d;1H\e[%dL\e[%dM",
+                            top, bottom, top + 1, 1 + flood_random(3), 1 + flood_random(3));
+            break;
     }
-#endif
+    flood_words(out, len, columns * 3 / 4);
+}
 
-    if(mesglen == 0) return 0; // SW_DO_FLUSH for example.
+static void
+flood_line_utf8(char *out, size_t *len, int columns, int rows)
+{
+    /* Two, three and four byte characters, and double width ones */
+    static const char *chars[] = {
+        "\xc3\xa5", "\xc3\xa4", "\xc3\xb6", "\xc3\xa9", "\xce\xbb", "\xce\xa9",
+        "\xd0\x96", "\xe2\x82\xac", "\xe2\x94\x80", "\xe2\x96\x88",
+        "\xe2\x94\x82", "\xf0\x9f\x90\x89"
+    };
+    static const char *wide[] = {
+        "\xe6\x97\xa5", "\xe6\x9c\xac", "\xe8\xaa\x9e", "\xed\x95\x9c"
+    };
+    int col = 0;
+    while(col < columns - 2) {
+        if(flood_random(4)) {
+            *len += sprintf(out + *len, "%s", chars[flood_random(sizeof(chars) / sizeof(chars[0]))]);
+            col++;
+        } else {
+            *len += sprintf(out + *len, "%s", wide[flood_random(sizeof(wide) / sizeof(wide[0]))]);
+            col += 2;
+        }
+    }
+}
 
-    if(clients[clientnr].writelen) {
-	output_queue *last = (output_queue *) & clients[clientnr].writebuff;
-	output_queue *noq;
-	int startpos = clients[clientnr].writelen % BLOCK_SIZE;
-	int size;
+static void
+flood_line_tiles(char *out, size_t *len, int columns, int rows)
+{
+    int col;
+    /* NetHack's vt_tiledata: select the map window, then a glyph
+     * per map position. */
+    *len += sprintf(out + *len, "\e[2;3z");
+    for(col = 0; col < columns; col++) {
+        *len += sprintf(out + *len, "\e[0;%dz%c\e[1z",
+                        flood_random(1000), '!' + flood_random(94));
+    }
+    *len += sprintf(out + *len, "\e[3z");
+}
 
-	clients[clientnr].writelen += mesglen;
-	if(clients[clientnr].writelen > DROP_AT) {
-	    /* The client has WAY too much queued text... Loose it! */
-	    clients[clientnr].mode |= SM_QUITING;
-	    FD_SET(clientnr, &select_write_fd_mask);
-	    return -1;
-	}
-	while(last->next)
-	    last = last->next;
-	size = mesglen;
-	if(size > (BLOCK_SIZE - startpos))
-	    size = BLOCK_SIZE - startpos;
-	memcpy(&last->text[startpos], mesg, size);
-	mesglen -= size;
-	mesg += size;
-	while(mesglen > 0) {
-	    noq = (output_queue*)malloc(sizeof(output_queue));
-	    noq->next = NULL;
-	    size = mesglen > BLOCK_SIZE ? BLOCK_SIZE : mesglen;
-	    memcpy(noq->text, mesg, size);
-	    mesg += size;
-	    mesglen -= size;
-	    last->next = noq;
-	    last = noq;
-	}
-	return 1;
-    } else {
-        int send_flags = 0;
-#ifdef MSG_MORE
-        // if(!(flags & SW_DO_FLUSH)) send_flags |= MSG_MORE;
-#endif
-	do {
-	    retval = send(clientnr, mesg, mesglen > 2 ? 2 : mesglen, send_flags);
-            if(retval == -1 && errno == ENOTSOCK) {
-                retval = write(clientnr, mesg, mesglen);
-            }
-	    if(retval != mesglen) {
+static void
+flood_line_zmp(char *out, size_t *len, int columns, int rows)
+{
+    /* A zmp.time message before every line of text */
+    char stamp[30];
+    const char *args[2] = { "zmp.time", stamp };
+    snprintf(stamp, sizeof(stamp), "2009-01-%02d %02d:%02d:%02d",
+             1 + flood_random(28), flood_random(24), flood_random(60),
+             flood_random(60));
+    *len += zmp_encode(out + *len, args, 2);
+    flood_words(out, len, columns);
+}
 
-		{
-		    int n = 0;
-		    socklen_t n_len = sizeof(n);
-		    if(0 == getsockopt(clientnr, SOL_SOCKET, SO_SNDBUF, &n, &n_len)) {
-                        /*
-			sprintf(debug_buffer, "Failed to write %d (%d) SO_SNDBUF %d %d\r\n",
-				mesglen, retval, clientnr, n);
-                        simple_write(clientnr, debug_buffer);
-                        */
-		    }
-		}
+static flood_pattern flood_patterns[] = {
+    { "text", "plain text", flood_line_text },
+    { "sgr", "text with 16 colour SGR codes", flood_line_sgr },
+    { "256", "a 256 colour change for every character", flood_line_256 },
+    { "cursor", "cursor addressing all over the screen", flood_line_cursor },
+    { "scroll", "scroll regions, reverse index, insert/delete lines", flood_line_scroll },
+    { "utf8", "UTF-8, with double width characters", flood_line_utf8 },
+    { "tiles", "NetHack vt_tiledata tiles", flood_line_tiles },
+    { "zmp", "a ZMP zmp.time message before every line", flood_line_zmp },
+    { NULL, NULL, NULL }
+};
 
-		if(retval > 0) {
-		    mesglen -= retval;
-		    mesg += retval;
-		} else {
-		    /* Store it in the queue */
-		    output_queue *last =
-			(output_queue *) & clients[clientnr].writebuff;
-
-		    FD_SET(clientnr, &select_write_fd_mask);
-
-		    while(mesglen > 0) {
-			output_queue *noq = (output_queue*)malloc(sizeof(output_queue));
-			int size = mesglen > BLOCK_SIZE ? BLOCK_SIZE : mesglen;
-
-			noq->next = NULL;
-			memcpy(noq->text, mesg, size);
-			clients[clientnr].writelen += size;
-			mesg += size;
-			mesglen -= size;
-			last->next = noq;
-			last = noq;
-		    }
-		}
-	    } else {
-#if HAVE_ZLIB
-                /* Turn on compression */
-                if((clients[clientnr].tos_us[COMPRESS2c] == tos_YES) &&
-                   !clients[clientnr].stream &&
-                   !(flags & SW_DONT_COMPRESS)) {
-                    z_stream *stream = calloc(1, sizeof(z_stream));
-                    stream->zalloc = Z_NULL;
-                    stream->zfree = Z_NULL;
-                    stream->opaque = Z_NULL;
-                    clients[clientnr].comp_buffer = calloc(sizeof(Bytef), COMP_BUFF_LEN);
-                    stream->next_out = clients[clientnr].comp_buffer;
-                    stream->avail_out = COMP_BUFF_LEN;
-                    if(deflateInit(stream, 6) != Z_OK) {
-                        fprintf(stderr, "Failed to initialise z_stream\n");
-                        free(stream);
-                        break;
-                    }
-                    /* IAC SB COMPRESS2 IAC SE */
-                    server_write(clientnr, IAC SB COMPRESS2 IAC SE, 5, SW_DONT_COMPRESS);
+static void
+make_flood(rendering *r)
+{
+    const flood_pattern *fp = &flood_patterns[r->arg];
+    char line[8192];
+
+    r->data = malloc(FLOOD_BUFF_LEN);
+    for(;;) {
+        size_t len = 0;
+        fp->line(line, &len, r->width, r->height);
+        line[len++] = '\r';
+        line[len++] = '\n';
+        if(r->len + len > FLOOD_BUFF_LEN) break;
+        memcpy(r->data + r->len, line, len);
+        r->len += len;
+    }
+}
 
-                    /* Start compression... */
-                    clients[clientnr].stream = stream;
+static bool
+flood_producer(int fd)
+{
+    flood_run *run = clients[fd].producer_data;
+    size_t size = run->r->len - run->offset;
 
-                    simple_write(clientnr, "SENT IAC SB COMPRESS2 IAC SE\r\n");
-                } else if((clients[clientnr].tos_us[COMPRESS2c] == tos_NO) &&
-                          clients[clientnr].stream) {
-                    server_write(clientnr, "Turning off COMPRESS2\r\n", 23, SW_FINISH|SW_DO_FLUSH);
-                }
-#endif
-		break;		/* We've sent it, we're done! */
-            }
-	} while(retval > 0);
+    if(!run->left) {
+        double secs = (now_ns() - run->start) / 1e9;
+        snprintf(debug_buffer, sizeof(debug_buffer), FLOOD_RESET,
+                 run->r->height);
+        simple_write(fd, debug_buffer);
+        snprintf(debug_buffer, sizeof(debug_buffer),
+                 "Flood done: %llu bytes in %.3f s, %.2f MB/s\r\n",
+                 (unsigned long long)run->sent, secs,
+                 secs > 0 ? run->sent / secs / (1024 * 1024) : 0.0);
+        simple_write(fd, debug_buffer);
+        return false;
     }
-    return retval;
+    if(size > PRODUCER_CHUNK) size = PRODUCER_CHUNK;
+    if(size >= run->left) {
+        /* End at a line, so no escape sequence is cut in half */
+        const char *data = run->r->data + run->offset;
+        size = run->left;
+        while(data[size - 1] != '\n')
+            size++;
+        run->left = 0;
+    } else {
+        run->left -= size;
+    }
+    server_write(fd, run->r->data + run->offset, size, 0);
+    run->sent += size;
+    run->offset += size;
+    if(run->offset == run->r->len)
+        run->offset = 0;
+    return true;
 }
 
-char *
-server_read(int clientnr)
+static void
+flood_stop(void *data)
 {
-    if(clients[clientnr].mode & SM_QUITING)
-	return NULL;		/* Client has disconected. */
-    else
-	return clients[clientnr].holdbuff;
+    flood_run *run = data;
+    put_rendering(run->r);
+    free(run);
 }
 
-void
-server_shutdown(void)
+static void
+handle_flood(int fd, char *args)
 {
-    int i;
-    for(i = 0; i < high_fd; i++)
-        if(FD_ISSET(i, &select_fd_mask)) {
-            if(i == daemon_fd)
-                close(i);
-            else
-                server_close(i);
+    const flood_pattern *fp;
+    const char *name = "text";
+    uint64_t size;
+    char *s = args;
+    flood_run *run;
+    int width, height;
+
+    while(*s && *s != ' ') s++;
+    if(*s) {
+        *s++ = 0;
+        while(*s == ' ') s++;
+        if(*s) name = s;
+    }
+    size = parse_size(args);
+    for(fp = flood_patterns; fp->name; fp++) {
+        if(!strcasecmp(fp->name, name)) break;
+    }
+    if(!size || !fp->name) {
+        simple_write(fd, "Usage: flood <bytes>[k|m|g] [<pattern>]\r\n"
+                         "The patterns are:\r\n");
+        for(fp = flood_patterns; fp->name; fp++) {
+            snprintf(debug_buffer, sizeof(debug_buffer), "  %-7s - %s\r\n",
+                     fp->name, fp->description);
+            simple_write(fd, debug_buffer);
         }
+        return;
+    }
+    screen_size(fd, &width, &height);
+    run = calloc(1, sizeof(flood_run));
+    run->r = get_rendering(render_flood, fp - flood_patterns, width, height);
+    run->left = size;
+    run->start = now_ns();
+    start_producer(fd, flood_producer, run, flood_stop);
 }
 
-void
-send_zmp(int fd, ...)
-{
-    va_list ap;
-    va_list aq;
-    char *s;
+/*
+ * tilestorm draws a NetHack like level the way NetHack's tty port does
+ * with the vt_tiledata option: the cursor is moved to a run of map
+ * positions and every position is sent as its tile number followed by
+ * the character. The first frame draws the whole map and the others
+ * only what changed, and the status line. All the frames are made the
+ * first time a map size is asked for, so sending one is only a write.
+ */
+#ifndef TILESTORM_FRAMES
+#define TILESTORM_FRAMES 64	/* Then the whole map is drawn again */
+#endif
 
-    va_start(ap, fd);
-    va_copy(aq, ap);
+typedef struct nh_tile {
+    short glyph;
+    char ch;			/* 0 for solid rock, that is not drawn */
+} nh_tile;
+
+/* Glyph numbers from NetHack 3.4.3, GLYPH_CMAP_OFF is 2341 */
+static const nh_tile nh_stone = { 2341, 0 };
+static const nh_tile nh_vwall = { 2342, '|' };
+static const nh_tile nh_hwall = { 2343, '-' };
+static const nh_tile nh_corner[4] = {
+    { 2344, '-' }, { 2345, '-' }, { 2346, '-' }, { 2347, '-' }
+};
+static const nh_tile nh_doorway = { 2353, '.' };
+static const nh_tile nh_door = { 2356, '+' };
+static const nh_tile nh_floor = { 2360, '.' };
+static const nh_tile nh_corridor = { 2361, '#' };
+static const nh_tile nh_upstair = { 2363, '<' };
+static const nh_tile nh_dnstair = { 2364, '>' };
+static const nh_tile nh_hero = { 344, '@' };
+
+/* Some monsters, a pet and objects that wander over the floor */
+static const nh_tile nh_things[] = {
+    { 0, 'a' }, { 13, 'd' }, { 42, 'F' }, { 71, 'h' }, { 94, 'k' },
+    { 120, 'o' }, { 170, 'x' }, { 236, ':' }, { 414, 'f' },
+    { 1907, ')' }, { 1976, '[' }, { 2106, '(' }, { 2146, '%' },
+    { 2166, '!' }, { 2196, '?' }, { 2306, '$' }, { 2316, '*' }
+};
 
-    server_write(fd, IAC SB ZMP, 3, 0);
-    while((s = va_arg(aq, char *))) {
-        char *x = s;
-        while(*x) {
-            if(*x == IACc) {
-                server_write(fd, IAC, 1, 0);
-            }
-            server_write(fd, x++, 1, 0);
-        }
-        server_write(fd, "", 1, 0);
+static bool
+is_tile(nh_tile a, nh_tile b)
+{
+    return a.glyph == b.glyph;
+}
+
+/* Rooms with corridors between them, like a dungeon level */
+static int
+tilestorm_level(nh_tile *map, int width, int height)
+{
+    int rooms[9][4];		/* Left, top, right and bottom walls */
+    int n = 0, tries, i, x, y;
+
+    for(i = 0; i < width * height; i++)
+	map[i] = nh_stone;
+    for(tries = 0; tries < 500 && n < 9; tries++) {
+	int w = 3 + flood_random(width / 6 > 3 ? width / 6 : 3);
+	int h = 2 + flood_random(height / 4 > 2 ? height / 4 : 2);
+	int left, top, j;
+
+	if(w + 2 > width || h + 2 > height)
+	    continue;
+	left = flood_random(width - w - 1);
+	top = flood_random(height - h - 1);
+	for(j = 0; j < n; j++) {
+	    if(left <= rooms[j][2] + 2 && left + w + 3 >= rooms[j][0] &&
+	       top <= rooms[j][3] + 1 && top + h + 2 >= rooms[j][1])
+		break;
+	}
+	if(j < n)
+	    continue;
+	rooms[n][0] = left;
+	rooms[n][1] = top;
+	rooms[n][2] = left + w + 1;
+	rooms[n][3] = top + h + 1;
+	for(y = top; y <= top + h + 1; y++) {
+	    for(x = left; x <= left + w + 1; x++) {
+		nh_tile *t = &map[y * width + x];
+		if(y == top || y == top + h + 1)
+		    *t = nh_hwall;
+		else if(x == left || x == left + w + 1)
+		    *t = nh_vwall;
+		else
+		    *t = nh_floor;
+	    }
+	}
+	map[top * width + left] = nh_corner[0];
+	map[top * width + left + w + 1] = nh_corner[1];
+	map[(top + h + 1) * width + left] = nh_corner[2];
+	map[(top + h + 1) * width + left + w + 1] = nh_corner[3];
+	n++;
     }
-    va_end(aq);
-    server_write(fd, IAC SE, 2, 0);
+    /* A corridor from the middle of every room to the next one */
+    for(i = 1; i < n; i++) {
+	int x2 = (rooms[i][0] + rooms[i][2]) / 2;
+	int y2 = (rooms[i][1] + rooms[i][3]) / 2;
+	x = (rooms[i - 1][0] + rooms[i - 1][2]) / 2;
+	y = (rooms[i - 1][1] + rooms[i - 1][3]) / 2;
+	while(x != x2 || y != y2) {
+	    nh_tile *t;
+	    if(x != x2)
+		x += x < x2 ? 1 : -1;
+	    else
+		y += y < y2 ? 1 : -1;
+	    t = &map[y * width + x];
+	    if(is_tile(*t, nh_stone))
+		*t = nh_corridor;
+	    else if(is_tile(*t, nh_vwall) || is_tile(*t, nh_hwall))
+		*t = flood_random(2) ? nh_door : nh_doorway;
+	}
+    }
+    if(!n) {
+	for(i = 0; i < width * height; i++)
+	    map[i] = nh_floor;
+	return width * height / 2;
+    }
+    map[(rooms[n - 1][1] + 1) * width + rooms[n - 1][0] + 1] = nh_dnstair;
+    map[(rooms[0][1] + 1) * width + rooms[0][2] - 1] = nh_upstair;
+    /* The hero stands in the middle of the first room */
+    return (rooms[0][1] + rooms[0][3]) / 2 * width +
+	   (rooms[0][0] + rooms[0][2]) / 2;
+}
 
-    simple_write(fd, "SENT IAC SB ZMP ");
-    while((s = va_arg(ap, char *))) {
-        simple_write(fd, "\"");
-        simple_write(fd, s);
-        simple_write(fd, "\" ");
+/* Draw the marked positions, a cursor movement before every run */
+static size_t
+tilestorm_draw(char *out, const nh_tile *map, const bool *marked,
+               int width, int height)
+{
+    size_t len = 0;
+    int x, y;
+
+    len += sprintf(out + len, "\e[2;3z");
+    for(y = 0; y < height; y++) {
+	bool in_run = false;
+	for(x = 0; x < width; x++) {
+	    const nh_tile *t = &map[y * width + x];
+	    if(!marked[y * width + x] || !t->ch) {
+		in_run = false;
+		continue;
+	    }
+	    if(!in_run)
+		len += sprintf(out + len, "\e[%d;%dH", y + 2, x + 1);
+	    len += sprintf(out + len, "\e[0;%dz%c\e[1z", t->glyph, t->ch);
+	    in_run = true;
+	}
     }
-    va_end(ap);
-    simple_write(fd, "IAC SE\r\n");
+    len += sprintf(out + len, "\e[3z");
+    return len;
 }
 
+/* The frames for a width x height map where percent of the floor
+ * changes between the frames */
 static void
-handle_zmp(int fd, char *line)
+make_tilestorm(rendering *r)
 {
-    /* split the args */
-    char *args[MAX_ZMP_ARGS];
-    int n_args = 1;
-    int i, len;
-    args[0] = line;
-    if(!*args) {
-        simple_write(fd, "USAGE: zmp cmd [<arg>|\"<arg>\"]*\r\n");
+    int width = r->width, height = r->height, percent = r->arg;
+    int cells = width * height;
+    nh_tile *level = malloc(cells * sizeof(nh_tile));
+    nh_tile *map = malloc(cells * sizeof(nh_tile));
+    bool *marked = malloc(cells * sizeof(bool));
+    int *open = malloc(cells * sizeof(int));
+    /* The longest a frame can be */
+    char *out = malloc(cells * 24 + 512);
+    char status[80];
+    int n_open = 0, changes, hero, f, i;
+
+    hero = tilestorm_level(level, width, height);
+    for(i = 0; i < cells; i++) {
+	if(i != hero && (is_tile(level[i], nh_floor) ||
+	                 is_tile(level[i], nh_corridor)))
+	    open[n_open++] = i;
     }
+    changes = n_open * percent / 100;
+    if(percent && !changes && n_open)
+	changes = 1;
+    memcpy(map, level, cells * sizeof(nh_tile));
+    map[hero] = nh_hero;
 
-    /* split the string into commands: */
-    do {
-        if(*line == '"') {
-            args[n_args-1]++;
-            line++;
-            /* XXX have some way of excaping " characters... */
-            while(*line && *line != '"') line++;
-            if(*line != '"') {
-                simple_write(fd, "ERROR: Unterminated ZMP argument\r\n");
-                return;
-            }
-            *line++ = 0;
-        } else {
-            while(*line && *line != ' ') line++;
-            if(*line) *line++ = 0;
-        }
-        while(*line == ' ') line++;
-        if(*line) {
-            args[n_args++] = line;
-        }
-    } while(*line && n_args < MAX_ZMP_ARGS);
+    r->frames = TILESTORM_FRAMES;
+    r->frame = malloc((r->frames + 1) * sizeof(size_t));
+    for(f = 0; f < r->frames; f++) {
+	size_t len = 0;
 
-    /* How large will the string be? */
-    len = 5; /* IAC SB ZMP IAC SE */
-    for(i = 0; i < n_args; i++) {
-        char *s = args[i];
-        while(*s) {
-            if(*s == IACc) len++;
-            len++;
-            s++;
-        }
-        len++; /* For the NUL */
+	if(!f) {
+	    len += sprintf(out, "\e[H\e[2J");
+	    memset(marked, true, cells * sizeof(bool));
+	} else {
+	    memset(marked, false, cells * sizeof(bool));
+	    for(i = 0; i < changes; i++) {
+		int pos = open[flood_random(n_open)];
+		if(is_tile(map[pos], level[pos]))
+		    map[pos] = nh_things[flood_random(sizeof(nh_things) /
+		                                      sizeof(nh_things[0]))];
+		else
+		    map[pos] = level[pos];
+		marked[pos] = true;
+	    }
+	}
+	len += tilestorm_draw(out + len, map, marked, width, height);
+	/* The message and status lines are cut at the screen's edge */
+	if(f % 8 == 1)
+	    len += sprintf(out + len, "\e[1;1H%.*s\e[K", width,
+	                   "You hear some noises in the distance.");
+	else if(f % 8 == 2)
+	    len += sprintf(out + len, "\e[1;1H\e[K");
+	len += sprintf(out + len, "\e[%d;1H%.*s\e[K", height + 2, width,
+	               "Mcts the Stripling  St:17 Dx:14 Co:18 In:8 Wi:10 Ch:7 Neutral");
+	snprintf(status, sizeof(status),
+	         "Dlvl:1 $:%d HP:16(16) Pw:2(2) AC:6 Xp:1/%d T:%d", 3 * f, f, 1 + f);
+	len += sprintf(out + len, "\e[%d;1H%.*s\e[K\e[%d;%dH",
+	               height + 3, width, status,
+	               hero / width + 2, hero % width + 1);
+	r->frame[f] = r->len;
+	r->data = realloc(r->data, r->len + len);
+	memcpy(r->data + r->len, out, len);
+	r->len += len;
     }
+    r->frame[f] = r->len;
+    free(level);
+    free(map);
+    free(marked);
+    free(open);
+    free(out);
+}
 
-    /* Allocate, build the string, send and free: */
-    line = (char*)malloc(len);
-    if(line) {
-        char *s = line;
-        *s++ = IACc;
-        *s++ = SBc;
-        *s++ = ZMPc;
-        simple_write(fd, "Sending: IAC SB ZMP ");
-        for(i = 0; i < n_args; i++) {
-            char *x = args[i];
-            simple_write(fd, "\"");
-            simple_write(fd, x);
-            simple_write(fd, "\" ");
-            while(*x) {
-                if(*x == IACc) *s++ = IACc;
-                *s++ = *x++;
-            }
-            *s++ = 0;
-        }
-        *s++ = IACc;
-        *s++ = SEc;
-        simple_write(fd, "IAC SE\r\n");
-        server_write(fd, line, s-line, 0);
-        free(line);
-    } else {
-        simple_write(fd, "ERROR: failed to allocate memory for the ZMP command\r\n");
-    }
+static void
+tilestorm_free(void *data)
+{
+    tilestorm *ts = data;
+    put_rendering(ts->r);
+    free(ts);
 }
 
 static void
-colour_show(int fd)
+tilestorm_report(int clinr, tilestorm *ts)
 {
-    int b;
-    const char cols[] = "nrgybmcwNRGYBMCW";
-    simple_write(fd, "These are the colours:\r\n  n  r  g  y  b  m  c  w  "
-            "N  R  G  Y  B  M  C  W\r\n");
-    for(b = 0; b < 8; b++) {
-        int bold;
-        char tmp[3] = "  ";
-        *tmp = cols[b];
-        simple_write(fd, tmp);
-        for(bold = 0; bold < 2; bold++) {
-            int f;
-            for(f = 0; f < 8; f++) {
-                if(bold) {
-                    sprintf(debug_buffer, "\e[1;3%d;4%dm%c%c \033[0m", f, b, cols[f+8], cols[b]);
-                } else {
-                    sprintf(debug_buffer, "\e[0;3%d;4%dm%c%c \033[0m", f, b, cols[f], cols[b]);
-                }
-                simple_write(fd, debug_buffer);
-            }
-        }
-        simple_write(fd, "\r\n");
+    double secs = (now_ns() - ts->start) / 1e9;
+
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "\e[0m\e[%d;1H\r\n"
+             "Tilestorm done: %u frames (%u skipped) in %.3f s, "
+             "%.1f fps, %.2f MB/s\r\n",
+             ts->r->height + 3, ts->shown, ts->skipped, secs,
+             secs > 0 ? ts->shown / secs : 0.0,
+             secs > 0 ? ts->sent / secs / (1024 * 1024) : 0.0);
+    simple_write(clinr, debug_buffer);
+}
+
+/* Without a frame rate, the frames are sent as fast as they are read */
+static bool
+tilestorm_producer(int fd)
+{
+    tilestorm *ts = clients[fd].producer_data;
+    const rendering *r = ts->r;
+    size_t end = r->frame[ts->current + 1];
+    size_t size = end - ts->offset;
+
+    if(ts->offset == r->frame[ts->current] && now_ns() >= ts->end) {
+	tilestorm_report(fd, ts);
+	return false;
     }
+    if(size > PRODUCER_CHUNK) size = PRODUCER_CHUNK;
+    server_write(fd, r->data + ts->offset, size, 0);
+    ts->sent += size;
+    ts->offset += size;
+    if(ts->offset == end) {
+	ts->shown++;
+	if(++ts->current == r->frames) {
+	    ts->current = 0;
+	    ts->offset = 0;
+	}
+    }
+    return true;
 }
 
 static void
-colour_show256(int fd)
+tilestorm_stop(int clinr)
 {
-    int c, i, j, r, g, b;
-    const char cols[] = "nrgybmcwNRGYBMCW";
-    const char rgb[] = "012345";
+    tilestorm_report(clinr, clients[clinr].tilestorm);
+    tilestorm_free(clients[clinr].tilestorm);
+    clients[clinr].tilestorm = NULL;
+    set_timer(clinr, timer_tilestorm, 0);
+}
 
-    simple_write(fd, "Basic colours:  ");
-    for(i = 0; i < 8; i++) {
-        sprintf(debug_buffer, "\033[3%dm%c", i, cols[i]);
-        simple_write(fd, debug_buffer);
+/*
+ * A frame is sent when it is due, unless the client has not read the
+ * earlier ones yet. Then it is skipped, but the next frame sent is
+ * still the one after the last one that was sent, or the client's map
+ * would be wrong.
+ */
+static void
+tilestorm_timer(int clinr, uint64_t now)
+{
+    tilestorm *ts = clients[clinr].tilestorm;
+
+    if(now >= ts->end) {
+	tilestorm_stop(clinr);
+	server_prompt(clinr, "> ", 2);
+	return;
     }
-    simple_write(fd, " ");
-    for(i = 0; i < 8; i++) {
-        sprintf(debug_buffer, "\033[4%dm%c", i, cols[i]);
-        simple_write(fd, debug_buffer);
+    if(now >= ts->next + ts->interval) {
+	uint64_t late = (now - ts->next) / ts->interval;
+	ts->skipped += late;
+	ts->next += late * ts->interval;
     }
-    simple_write(fd, "\033[0m\r\nBright colours: \033[1m");
-    for(i = 0; i < 8; i++) {
-        sprintf(debug_buffer, "\033[3%dm%c", i, cols[i+8]);
-        simple_write(fd, debug_buffer);
+    if(clients[clinr].writelen < clients[clinr].high_water) {
+	const rendering *r = ts->r;
+	size_t start = r->frame[ts->current];
+	size_t len = r->frame[ts->current + 1] - start;
+	server_write(clinr, r->data + start, len, 0);
+	ts->sent += len;
+	ts->shown++;
+	ts->current = (ts->current + 1) % r->frames;
+    } else {
+	ts->skipped++;
     }
-    simple_write(fd, " ");
+    ts->next += ts->interval;
+    set_timer(clinr, timer_tilestorm, ts->next < ts->end ? ts->next : ts->end);
+}
 
-    for(i = 0; i < 8; i++) {
-        sprintf(debug_buffer, "\033[4%dm%c", i, cols[i]);
-        simple_write(fd, debug_buffer);
+static void
+handle_tilestorm(int fd, const char *args)
+{
+    double fps = -1, seconds = 10;
+    int width, height, percent = 10, n;
+    tilestorm *ts;
+
+    /* The map fills the screen, except the message and status lines */
+    screen_size(fd, &width, &height);
+    height -= 3;
+    n = sscanf(args, "%lf %lf %dx%d %d",
+               &fps, &seconds, &width, &height, &percent);
+
+    if(!strcasecmp(args, "stop")) {
+	if(clients[fd].tilestorm) {
+	    tilestorm_stop(fd);
+	} else if(clients[fd].producer == tilestorm_producer) {
+	    tilestorm_report(fd, clients[fd].producer_data);
+	    stop_producer(fd);
+	}
+	return;
     }
-    simple_write(fd, "\033[0m\r\n\r\n6x6x6 colour cubes:\r\n  R");
+    if(n < 1 || n == 3 || fps < 0 || fps > 1000 || seconds <= 0 ||
+       width < 10 || width > 250 || height < 5 || height > 100 ||
+       percent < 0 || percent > 100) {
+	simple_write(fd, "Usage: tilestorm <fps> [<seconds>] [<width>x<height>] [<percent changed>]\r\n"
+	                 "       tilestorm stop\r\n"
+	                 "fps 0 sends the frames as fast as the client reads them.\r\n"
+	                 "The default is 10 seconds of a map as large as the screen with\r\n"
+	                 "10% changed per frame.\r\n");
+	return;
+    }
+    if(clients[fd].tilestorm)
+	tilestorm_stop(fd);
+    if(clients[fd].producer == tilestorm_producer)
+	stop_producer(fd);
+    ts = calloc(1, sizeof(tilestorm));
+    ts->r = get_rendering(render_tilestorm, percent, width, height);
+    ts->start = now_ns();
+    ts->end = ts->start + (uint64_t)(seconds * 1e9);
+    if(fps > 0) {
+	ts->interval = 1e9 / fps;
+	ts->next = ts->start;
+	clients[fd].tilestorm = ts;
+	set_timer(fd, timer_tilestorm, ts->next);
+    } else {
+	start_producer(fd, tilestorm_producer, ts, tilestorm_free);
+    }
+}
 
-    for(i = 0; i < 6; i++)
-        simple_write(fd, rgb);
-    simple_write(fd, " ");
+/*
+ * "testtext 4" for the width the client sent with NAWS: a line that
+ * fills the screen and should not be wrapped, then lines that are one
+ * character too long.
+ */
+static void
+wrap_test_line(rendering *r, int width, const char *start)
+{
+    static const char *words[] = {
+        "xyzzy", "hocus", "pocus", "plugh", "shazam", "alakazam", "plover",
+        "abracadabra", "klaatu", "barada", "nikto!", "hocus-pocus", "a"
+    };
+    char *out = r->data + r->len;
+    int len = sprintf(out, start, width);
+
+    while(len < width) {
+        const char *w = words[flood_random(sizeof(words) / sizeof(words[0]))];
+        int wlen = strlen(w);
+        if(len == width - 1) {
+            out[len++] = '.';
+        } else if(len + 1 + wlen <= width) {
+            len += sprintf(out + len, " %s", w);
+        }
+    }
+    memcpy(out + len, "\r\n", 2);
+    r->len += len + 2;
+}
 
-    for(i = 0; i < 6; i++)
-        simple_write(fd, rgb);
-    
-    simple_write(fd, "\r\n  G");
+static void
+make_wrap_test(rendering *r)
+{
+    bool narrow = r->width < 50;
+    int i;
 
-    for(c = 0; c < 2; c++) {
-        if(c == 1) simple_write(fd, " ");
-        for(i = 0; i < 6; i++)
-            for(j = 0; j < 6; j++) {
-                *debug_buffer = i + '0';
-                debug_buffer[1] = 0;
-                simple_write(fd, debug_buffer);
-            }
-    }
-    simple_write(fd, "\r\n");
-    for(b = 0; b < 6; b++) {
-        sprintf(debug_buffer, "B%d ", b);
-        simple_write(fd, debug_buffer);
-        for(g = 0; g < 6; g++) {
-            for(r = 0; r < 6; r++) {
-                sprintf(debug_buffer, "\033[38;5;%dmX", 16+r*36+g*6+b);
-                simple_write(fd, debug_buffer);
-            }
-        }
-        simple_write(fd, "\033[0m ");
-        for(g = 0; g < 6; g++) {
-            for(r = 0; r < 6; r++) {
-                sprintf(debug_buffer, "\033[48;5;%dmX", 16+r*36+g*6+b);
-                simple_write(fd, debug_buffer);
-            }
-        }
-        simple_write(fd, "\033[0m\r\n");
+    r->data = malloc(5 * (r->width + 3) + 128);
+    r->len = sprintf(r->data, "This test assumes the screen is %d characters wide.\r\n",
+                     r->width);
+    wrap_test_line(r, r->width, narrow ? "%d: not wrapped." :
+                   "This %d character line should not be wrapped.");
+    for(i = 0; i < 4; i++)
+        wrap_test_line(r, r->width + 1, narrow ? "%d: wrapped." :
+                       "This %d character line should be wrapped.");
+}
+
+static void
+wrap_test(int fd)
+{
+    rendering *r;
+    int width, height;
+
+    screen_size(fd, &width, &height);
+    r = get_rendering(render_wrap_test, 0, width, 0);
+    server_write(fd, r->data, r->len, 0);
+    put_rendering(r);
+}
+
+typedef struct cat_run {
+    int f;
+    int left;			/* Bytes left to send */
+} cat_run;
+
+static bool
+cat_producer(int fd)
+{
+    cat_run *run = clients[fd].producer_data;
+    char buff[PRODUCER_CHUNK / 2];
+    char out[PRODUCER_CHUNK];
+    int len = run->left < (int)sizeof(buff) ? run->left : (int)sizeof(buff);
+    int i, n = 0;
+
+    if(len <= 0 || (len = read(run->f, buff, len)) <= 0)
+	return false;
+    run->left -= len;
+    for(i = 0; i < len; i++) {
+	if(buff[i] == '\n')
+	    out[n++] = '\r';
+	out[n++] = buff[i];
     }
+    server_write(fd, out, n, 0);
+    return true;
+}
+
+static void
+cat_stop(void *data)
+{
+    cat_run *run = data;
+    close(run->f);
+    free(run);
+}
 
-    simple_write(fd, "\r\nGreyscales (0-23): ");
+static void
+handle_cat(int fd, const char *args)
+{
+    int max = atoi(args);
+    int f = open("test.txt", O_RDONLY);
+    cat_run *run;
 
-    for(i = 0; i < 24; i++) {
-        sprintf(debug_buffer, "\033[38;5;%dmX", 16+6*6*6+i);
-        simple_write(fd, debug_buffer);
-    }
-    simple_write(fd, " ");
-    for(i = 0; i < 24; i++) {
-        sprintf(debug_buffer, "\033[48;5;%dmX", 16+6*6*6+i);
-        simple_write(fd, debug_buffer);
+    if(f < 0) {
+	perror("test.txt");
+	simple_write(fd, "Could not find test.txt\r\n");
+	return;
     }
-    simple_write(fd, "\033[0m\r\n");
+    run = malloc(sizeof(cat_run));
+    run->f = f;
+    run->left = max > 0 ? max : INT_MAX;
+    start_producer(fd, cat_producer, run, cat_stop);
 }
 
 static void
-send_data(int fd, char *line)
+handle_stats(int fd)
 {
-    char *s;
-    if(!*line) {
-        simple_write(fd, "USAGE: senddata <hex byte> <hex byte>*\r\nExample: senddata 41 42 43  -- sends ABC\r\n");
-        return;
+    uint64_t total = 0, input = 0;
+    int i, n = 0, n_renderings = 0;
+    const rendering *r;
+
+    simple_write(fd, "Output queues:\r\n"
+                     " fd session   queued deferred      max  high/low/drop\r\n");
+    for(i = 0; i < high_fd; i++) {
+	if(!clients[i].is_connected) continue;
+	snprintf(debug_buffer, sizeof(debug_buffer),
+	         "%3d %7u %8u %8u %8u  %u/%u/%u%s%s\r\n",
+	         i, clients[i].session, clients[i].writelen,
+	         clients[i].deferlen, clients[i].max_writelen,
+	         clients[i].high_water, clients[i].low_water,
+	         clients[i].drop_at,
+	         clients[i].producer ? " producing" : "",
+	         clients[i].paused ? " (paused)" : "");
+	simple_write(fd, debug_buffer);
     }
-    while((s = strtok(line, " "))) {
-        int x;
-        line = 0;
-        if(sscanf(s, "%x", &x) != 1 || x > 255 || x < 0) {
-            simple_write(fd, "\r\nERROR: Unknown byte.\r\n");
-            return;
-        } else {
-            char c = (char)x;
-            server_write(fd, &c, 1, 0);
-        }
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Queue depth when writable: n=%llu p50=%llu p99=%llu p999=%llu max=%llu\r\n"
+             "Producer pauses: %llu, deferred broadcast bytes: %llu, dropped clients: %llu\r\n",
+             (unsigned long long)queue_depth.count,
+             (unsigned long long)hist_percentile(&queue_depth, 50),
+             (unsigned long long)hist_percentile(&queue_depth, 99),
+             (unsigned long long)hist_percentile(&queue_depth, 99.9),
+             (unsigned long long)queue_depth.max,
+             (unsigned long long)producer_pauses,
+             (unsigned long long)deferred_bytes,
+             (unsigned long long)dropped_clients);
+    simple_write(fd, debug_buffer);
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Timers: %d set, idle clients closed: %llu, keepalives sent: %llu\r\n",
+             active_timers, (unsigned long long)idle_reaped,
+             (unsigned long long)keepalives_sent);
+    simple_write(fd, debug_buffer);
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Echo: %llu bytes in %llu writes\r\n",
+             (unsigned long long)echo_bytes, (unsigned long long)echo_flushes);
+    simple_write(fd, debug_buffer);
+    for(i = 0; i < high_fd; i++) {
+	if(!clients[i].is_connected) continue;
+	input += clients[i].insize + clients[i].line_size + clients[i].sb_size;
+	n++;
+    }
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Memory: %u bytes per client slot, input arenas %llu bytes"
+             " (%llu per client), max line %u bytes\r\n",
+             (unsigned)sizeof(Clients), (unsigned long long)input,
+             (unsigned long long)(n ? input / n : 0), max_line);
+    simple_write(fd, debug_buffer);
+    for(i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+	snprintf(debug_buffer, sizeof(debug_buffer),
+	         "Pool %s: %d in use, peak %d, %d free, %llu hits, %llu misses"
+	         " (%u bytes each)\r\n",
+	         pools[i]->name, pools[i]->in_use, pools[i]->peak, pools[i]->n_free,
+	         (unsigned long long)pools[i]->hits,
+	         (unsigned long long)pools[i]->misses, (unsigned)pools[i]->size);
+	simple_write(fd, debug_buffer);
+    }
+    for(r = renderings; r; r = r->next)
+	n_renderings++;
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Rendered output: %d kept, %llu kB, %llu hits, %llu misses\r\n",
+             n_renderings, (unsigned long long)rendering_bytes / 1024,
+             (unsigned long long)rendering_hits,
+             (unsigned long long)rendering_misses);
+    simple_write(fd, debug_buffer);
+    snprintf(debug_buffer, sizeof(debug_buffer), "Backend: %s, system calls:",
+             backend_names[backend]);
+    simple_write(fd, debug_buffer);
+    for(i = 0; i < sc_count; i++) {
+	snprintf(debug_buffer, sizeof(debug_buffer), " %s %llu", syscall_names[i],
+	         (unsigned long long)syscalls[i]);
+	simple_write(fd, debug_buffer);
+	total += syscalls[i];
+    }
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "\r\nLines: %llu, %.2f system calls per line\r\n",
+             (unsigned long long)lines_processed,
+             lines_processed ? (double)total / lines_processed : 0.0);
+    simple_write(fd, debug_buffer);
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Lines per batch: mean %llu, p99 %llu, max %llu (quota %d)\r\n",
+             (unsigned long long)hist_mean(&batch_size),
+             (unsigned long long)hist_percentile(&batch_size, 99),
+             (unsigned long long)batch_size.max, LINE_QUOTA);
+    simple_write(fd, debug_buffer);
+    snprintf(debug_buffer, sizeof(debug_buffer),
+             "Loop turns: p50 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus,"
+             " %llu stalls over %llu ms\r\n",
+             hist_percentile(&loop_time, 50) / 1e3,
+             hist_percentile(&loop_time, 99) / 1e3,
+             hist_percentile(&loop_time, 99.9) / 1e3, loop_time.max / 1e3,
+             (unsigned long long)stalls, (unsigned long long)stall_ns / 1000000);
+    simple_write(fd, debug_buffer);
+
+    for(i = 0; i < high_fd; i++) {
+	zmp_echo *ze = clients[i].zmp_echo;
+	if(!clients[i].is_connected || !ze) continue;
+	snprintf(debug_buffer, sizeof(debug_buffer),
+	         "ZMP echo fd %d: %u sent, %u echoed, p50=%.1fus p99=%.1fus max=%.1fus\r\n",
+	         i, ze->sent, ze->echoed,
+	         hist_percentile(&ze->rtt, 50) / 1e3,
+	         hist_percentile(&ze->rtt, 99) / 1e3,
+	         ze->rtt.max / 1e3);
+	simple_write(fd, debug_buffer);
+    }
+    if(zmp_echo_rtt.count) {
+	snprintf(debug_buffer, sizeof(debug_buffer),
+	         "ZMP echo, finished runs: n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\r\n",
+	         (unsigned long long)zmp_echo_rtt.count,
+	         hist_percentile(&zmp_echo_rtt, 50) / 1e3,
+	         hist_percentile(&zmp_echo_rtt, 99) / 1e3,
+	         hist_percentile(&zmp_echo_rtt, 99.9) / 1e3,
+	         zmp_echo_rtt.max / 1e3);
+	simple_write(fd, debug_buffer);
     }
-    simple_write(fd, "\r\n");
 }
 
+#if MCTS_PROFILE
+/* Writes the profile to the client, or to stdout if fd is -1 */
 static void
-set_var(int fd, const char *key, const char *value)
+prof_report(int fd)
 {
-    key_value *curr = clients[fd].variables;
-    while(curr) {
-	if(!strcmp(curr->key, key)) {
-	    // Update.
-	    free(curr->value);
-	    curr->value = strdup(value);
-	    return;
+#if defined(__x86_64__) || defined(__i386__)
+    static const char unit[] = "cycles";
+#else
+    static const char unit[] = "ns";
+#endif
+    int i;
+    for(i = 0; i < prof_count; i++) {
+	const histogram *h = &prof_hist[i];
+	snprintf(debug_buffer, sizeof(debug_buffer),
+	         "%-13s %10llu calls, mean %llu, p50 %llu, p99 %llu, p999 %llu,"
+	         " max %llu %s",
+	         prof_names[i], (unsigned long long)h->count,
+	         (unsigned long long)hist_mean(h),
+	         (unsigned long long)hist_percentile(h, 50),
+	         (unsigned long long)hist_percentile(h, 99),
+	         (unsigned long long)hist_percentile(h, 99.9),
+	         (unsigned long long)h->max, unit);
+	if(fd < 0) {
+	    printf("%s\n", debug_buffer);
+	} else {
+	    simple_write(fd, debug_buffer);
+	    simple_write(fd, "\r\n");
 	}
-	curr = curr->next;
     }
-    // New value.
-    curr = malloc(sizeof(key_value));
-    curr->next = clients[fd].variables;
-    curr->key = strdup(key);
-    curr->value = strdup(value);
-    clients[fd].variables = curr;
+    if(fd < 0)
+	fflush(stdout);
 }
 
 static void
-remove_var(int fd, const char *key)
+handle_prof_signal(int sig)
 {
-    key_value *last = clients[fd].variables;
-    if(!last) return;
-    if(!strcmp(last->key, key)) {
-	clients[fd].variables = last->next;
-	free(last->key);
-	free(last->value);
-	free(last);
-	return;
+    prof_requested = 1;
+}
+#endif
+
+static void
+handle_prof(int fd, const char *args)
+{
+#if MCTS_PROFILE
+    int i;
+    if(!strcasecmp(args, "reset")) {
+	for(i = 0; i < prof_count; i++)
+	    hist_clear(&prof_hist[i]);
+	simple_write(fd, "The profile is cleared.\r\n");
+    } else {
+	prof_report(fd);
     }
-    while(last->next) {
-	key_value *curr = last->next;
-	if(!strcmp(curr->key, key)) {
-	    last->next = curr->next;
-	    free(curr->key);
-	    free(curr->value);
-	    free(curr);
+#else
+    simple_write(fd, "This server is built without profiling, see \"make profile\".\r\n");
+#endif
+}
+
+/*
+ * Metrics. With "-M <port>" the server answers HTTP requests on that
+ * port on the loopback interface with its counters, in the Prometheus
+ * text format. The requests are clients with http set, so they are read
+ * and written by the backends like the others, but the main loop never
+ * sees them: http_input() answers a request when its headers are in,
+ * and server_poll() closes it when the answer is sent.
+ */
+#ifndef MAX_COUNTED_COMMANDS
+#define MAX_COUNTED_COMMANDS 48
+#endif
+
+/* How many times each command was given, the ones that don't fit
+ * are counted in other_commands */
+static struct {
+    char name[16];
+    uint64_t count;
+} command_counts[MAX_COUNTED_COMMANDS];
+static int n_command_counts;
+static uint64_t other_commands;
+
+static void
+count_command(const char *command)
+{
+    char name[16];
+    int i;
+
+    for(i = 0; command[i] && i < sizeof(name) - 1; i++)
+	name[i] = isalnum((unsigned char)command[i]) ?
+	          tolower((unsigned char)command[i]) : '_';
+    name[i] = 0;
+    for(i = 0; i < n_command_counts; i++) {
+	if(!strcmp(command_counts[i].name, name)) {
+	    command_counts[i].count++;
 	    return;
 	}
-	last = last->next;
     }
+    if(n_command_counts == MAX_COUNTED_COMMANDS) {
+	other_commands++;
+	return;
+    }
+    strcpy(command_counts[n_command_counts].name, name);
+    command_counts[n_command_counts++].count = 1;
 }
 
 static void
-handle_set(int fd, char *args)
+http_accept(int fd)
 {
-    if(!*args) {
-	key_value *curr = clients[fd].variables;
-	if(!curr) {
-	    simple_write(fd, "No variables are set.\r\n"
-		    "Use \"set var value\" to set the \"var\" variable to \"value\".\r\n"
-		    "Use \"set var\" to unset the \"var\" variable.\r\n"
-		    "Known variables are:\r\n"
-		    "  nodebug - if set to any value, stops telnet options from being displayed.\r\n"
-		    );
-	} else {
-	    while(curr) {
-		sprintf(debug_buffer, "%s=%s\r\n", curr->key, curr->value);
-		simple_write(fd, debug_buffer);
-		curr = curr->next;
-	    }
-	}
-    } else {
-	char *key = args;
-	char *value = NULL;
-	while(*args++) {
-	    if(*args == ' ') {
-		*args = 0;
-		value = args+1;
-		break;
-	    }
-	}
-	if(value && !*value) value = NULL;
+    memset(&clients[fd], 0, sizeof(clients[fd]));
+    if(fd >= high_fd) high_fd = fd + 1;
+    clients[fd].http = true;
+    clients[fd].high_water = default_high_water;
+    clients[fd].low_water = default_low_water;
+    clients[fd].drop_at = default_drop_at;
+    clients[fd].last_input = now_ns();
+    clients[fd].idle_timeout = HTTP_TIMEOUT;
+    set_timer(fd, timer_idle, clients[fd].last_input + HTTP_TIMEOUT * 1000000000ULL);
+    clients[fd].is_connected = true;
+    clients[fd].session = ++next_session;
+#if HAVE_EPOLL
+    if(backend == backend_epoll)
+	epoll_add(fd);
+#endif
+}
 
-	if(value) {
-	    set_var(fd, key, value);
-	} else {
-	    remove_var(fd, key);
+/* Accept the waiting metrics requests, for select and epoll */
+static void
+metrics_accept(void)
+{
+    listener *l;
+    int fd;
+
+    while((l = pending_listener(listen_metrics))) {
+	syscalls[sc_accept]++;
+#ifdef SOCK_NONBLOCK
+	fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	fd = accept(l->fd, NULL, NULL);
+	if(fd >= 0)
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+	if(fd < 0) {
+	    if(errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    l->pending = false;
+	    continue;
 	}
+	if(fd >= max_fd)
+	    close(fd);
+	else
+	    http_accept(fd);
     }
+    metrics_pending = false;
 }
 
 static void
-test_cc(int fd, const char *args)
+metric(blob *b, const char *name, const char *type, const char *help, double value)
 {
-    switch(atoi(args)) {
-        case 1:
-            simple_write(fd,
-                    "\e[3H\e[2J>\e[HX\e[;5HV\e[1;1H "
-                    "\r\n"
-                    "\e[3;5H"
-                    "* - should be pointed to by V and > (line 3, column 5)\r\n"
-                    "\r\nThe screen should only contain this text, "
-                    "the message above, \"V\", \">\"\r\n"
-                    "and \"* -\" plus the new prompt. "
-                    "The V should be on the first line,\r\n"
-                    "the > in the first column and this is the only X.\r\n");
-            break;
-        case 2:
-            simple_write(fd,
-                         "\e[H\e[2J"
-                         "123456789>\r\n"
-                         "2   YY\r\n"
-                         "3  YabY\r\n"
-                         "4  YcdY\r\n"
-                         "5   YY\r\n"
-                         "V\r\n"
-                         "\e[H"
-                         "\e[B\e[2B\e[C\e[4CDX"
-                         "\e[2A\e[3D  \e[D\e[2D\e[B AX "
-                         "\e[E"
-			 "\e[3C C"
-                         "\e[F\e[2F\e[5C\e[2BB"
-                         "\e[6G\e[2B \e[5G "
-                         "\e[4;7H "
-                         "\r\n\r\n\r\n\r\n"
-                         "The screen should now show \"AB\" "
-                         "and below it \"CD\".\r\n"
-                         "A should be shown in the third row, "
-                         "fifth column.\r\n");
-            break;
-        case 3:
-            simple_write(fd,
-                         "\e[H\e[2J"
-                         "XXXXXXXXXXXXXXXXXXXX\r\n"
-                         "XXXXXXXXX#XXXXXXXXXX\r\n"
-                         "XXXXXXX#####XXXXXXXX\r\n"
-                         "XXXXXXXXXXXXXXXXXXXX\r\n"
-                         "XXXXXXXXX#XXXXXXXXXX\r\n"
-                         "XXXXXXXXXXXXXXXXXXXX\r\n"
-                         "\e[2;9H\e[1J"
-                         "\e[11G\e[K"
-                         "\e[3;7H\e[1K"
-                         "\e[13G\e[0K"
-                         "\e[5;11H\e[J\e[2D\e[1K"
-                         "\e[A\e[2K"
-                         "\r\n\r\n\r\n\r\n"
-                         "This is the only \"X\" that should be visible. "
-                         "Line one, four and six should\r\n"
-                         "be empty. If line four were to be removed, a 3x5 character\r\n"
-                         "large plus-sign would be visible, "
-                         "made of 7 characters.\r\n"
-                    );
-            break;
-        case 4:
-            simple_write(fd,
-                         "\r\n"
-                         "\e(0"
-                         "lqwqk    " "\r\n"
-                         "xAxBx    " "\r\n"
-                         "tqnqu    " "\r\n"
-                         "xCxDx    " "\r\n"
-                         "mqvqj    " "\r\n"
-                         "y z a ` f g\e(B\r\n\r\n"
-                         "A, B, C and D should be nicely framed with lines, then a line of symbols;\r\n"
-                         "<=, >=, checkers, a diamond, a degree-sign and finally +-\r\n"
-                         );
-            break;
-        case 5:
-            simple_write(fd,
-                         "\r\n"
-                         "\e[2J\e[H\r\n"
-                         "\e[33;41;1m"
-                         "Storing the cursor here.\e7XXXXXX\r\n"
-                         "\e[0;32;40mChanging cursor colour.\r\n"
-                         "\e8XXXXXXXXXXXXX\r\n"
-                         "\e8 After restoration of cursor.\e[m\r\n\r\n\r\n"
-                         "The first row is empty, the second row should read:\r\n"
-                         "Storing the cursor here. After restoration of cursor.\r\n"
-                         "The colour of the second row is bright yellow on a red background,\r\n"
-                         "the third row is written in dark green above a black background.\r\n"
-                         "This is the only X.\r\n"
-                    );
-            break;
-        case 6:
-            simple_write(fd,
-                    "\e[2J\e[H"
-                    "1\r\n" "X\r\n" "X\r\n" "X\r\n" "5\r\n"
-                    "\e[;3HXXXACF"
-                    "\e[3G" // CHA - cursor character absolute; pos becomes 1,3
-		    "\e[P"  // DCH - delete character; "XXACF"
-		    "\e[2P" // DCH - delete character; "ACF"
-                    "\e[4G" // CHA - cursor pos becomes 1,4
-		    "\e[@"  // ICH - insert space...; "A CF"
-		    "\e[2C" // CUF - Cursor Forward, pos becomes 1,6
-		    "\e[2@" // ICH - insert space...; "A C  F"
-                    "\e[4G" // CHA - cursor pos becomes 1,4
-		    "B"     //                        "ABC  F"
-		    "\e[6G" // CHA - cursor pos comes 1,6
-		    "DE"    //                        "ABCDEF"
-                    "\e[2H"
-		    "\e[M"  // DL
-		    "\e[2M"
-		    "\e[L"  // IL
-		    "\e[2L" // IL
-                    "\e[2H"
-		    "2\r\n3\r\n4"
-                    "\e[5;3H"
-		    "a\e[2b"     // REP
-		    "b\e[b"      // REP
-		    "c\e[1b\e[b" // REP
-		    "d"
-                    "\r\n\r\n\r\n"
-                    "The first row should be: \"1 ABCDEF\".\r\n"
-                    "There should be a column with 1..5 "
-                    "and this is the only X.\r\n"
-                    "The fifth row should be \"5 aaabbccd\" or \"5 aaabbcccd\"\r\n"
-                    );
-            break;
-        case 7:
-            simple_write(fd,
-                    "\e]0;Window and icon name\007"
-                    "\e]1;Icon name\007"
-                    "\e]2;Window title\007"
-                    "The window title should now be \"Window title\"\r\n"
-                    "The icon name should now be \"Icon name\"\r\n");
-            break;
-        case 8:
-            simple_write(fd,
-                    "\e[2J" // ED2 - Clear entire screen.
-		    "\e[6;0H" // CUP - Move to (col,row) - (1,6).
-		    "6"
-		    "\e[;4r" // DECSTBM - Sets Top and Bottom Margins to 1 and 4. Moves cursor to (1,1).
-                    "X\r\n" "X\r\n" "X\r\n" "X\r\n"
-                    "2\r\n" "X\r\n" "X"
-                    "\e[3;5r" // DECSTBM - Sets Top and Bottom Margins to 3,5. Moves cursor to (1,1).
-		    "X\r\n"
-                    "\r\n"
-		    "X\r\n"
-		    "X\r\n"
-		    "3\r\n"
-		    "4\r\n"
-                    "\e[r1" // DECSTBM - Sets Top and Bottom Margsins to 1 and number of lines. Moves cursor to (1,1).
-		    "\e[5;1H" // CUP - Move to (1,5).
-		    "5"
-		    "\r\n" "\r\n" "\r\n"
-                    "A column with 1..6 is shown, starting at the first row. "
-                    "This is the only X.\r\n"
-                   );
-	    simple_write(fd, "\e[10H");
-            break;
-        case 9:
-            simple_write(fd, "\ec\r\n");
-            break;
-        case 10:
-	    simple_write(fd,
-                    "\e[2J" // ED2 - Clear entire screen.
-		    "\e[5;1H" // CUP - Move to (col,row) - (1,5).
-		    "6"
-		    "\e[1;1H" // CUP - Move to (col,row) - (1,1).
-		    "2"
-		    "\eM" // Reverse index.
-		    "\010" // BACKSPACE
-		    "1"
-                    "\e[3;5r" // DECSTBM - Sets Top and Bottom Margins to 3,5. Moves cursor to (1,1).
-                    "\r\n\r\n" // Move cursor down two steps.
-		    "X"
-		    "\eM" // Reverse index.
-		    "\010" // BACKSPACE
-		    "5"
-		    "\eM" // Reverse index.
-		    "\010" // BACKSPACE
-		    "4"
-		    "\eM" // Reverse index.
-		    "\010" // BACKSPACE
-		    "3"
-		    "\e[H" // HOME - Moves the cursor to (1,1).
-		    "\eM" // Reverse index.
-		    "This is the last line of the screen."
-                    "\e[r1" // DECSTBM - Sets Top and Bottom Margsins to 1 and number of lines. Moves cursor to (1,1).
-		    "\e[8;1H"
-		    "The screen should show 1..6 from the upper left corner and down.\r\n"
-		    "The last line should have a text about it. This is the only X.\r\n");
-	    break;
-	case 11:
-	    simple_write(fd,
-		"This should show a single tile:\r\n"
-		"\e[2;3z" // Output to window 3 == MAP.
-		);
-		int i;
-		for(i = 0; i < 80; i++) {
-			char buff[80];
-			snprintf(buff, 79,
-					"\e[0;%uz" // Start of glyph 1
-					"X" // This should not be shown.
-					"\e[1z" // End of glyph
-					, i);
-			simple_write(fd, buff);
-		}
-	    simple_write(fd,
-		"\e[3z" // End of data.
-		"\r\nThis is the only X.\r\n"
-		    );
-	    break;
+    blob_printf(b, "# HELP mcts_%s %s\n# TYPE mcts_%s %s\nmcts_%s %.15g\n",
+                name, help, name, type, name, value);
+}
 
-        default:
-            simple_write(fd,
-      "VT100/102 & xterm tests:\r\n"
-      "testcc 1  - clears the screen, absolute cursor movement tests.\r\n"
-      "testcc 2  - clears the screen, relative cursor movement tests.\r\n"
-      "testcc 3  - erase tests.\r\n"
-      "testcc 4  - \"DEC\" graphics.\r\n"
-      "testcc 5  - storing/restoring the cursor.\r\n"
-      "testcc 6  - text insertion tests.\r\n"
-      "testcc 7  - xterm icon & window title tests.\r\n"
-      "testcc 8  - scroll region tests.\r\n"
-      "testcc 9  - reset the terminal.\r\n"
-      "testcc 10 - test Reverse Index.\r\n"
-      "testcc 11 - NetHack's vt_tileset patch's output.\r\n"
-            );
-    }
-#if 0
-    simple_write(fd, "\e[23;1H\e[2K\e7\e[1;1H\e[r\e[2J\e[1;20r\e8");
-    simple_write(fd, "\e7\e[20;1HHi there...\r\n");
-    sleep(5);
-    simple_write(fd, "\e8");
-    sleep(5);
-    simple_write(fd, "\e[r\r\n");
+/* A histogram as a summary, with the values scaled by scale */
+static void
+metric_summary(blob *b, const char *name, const char *help,
+               const histogram *h, double scale)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    int i;
+
+    blob_printf(b, "# HELP mcts_%s %s\n# TYPE mcts_%s summary\n", name, help, name);
+    for(i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+	blob_printf(b, "mcts_%s{quantile=\"%g\"} %.15g\n", name, quantiles[i],
+	            hist_percentile(h, quantiles[i] * 100) * scale);
+    blob_printf(b, "mcts_%s_sum %.15g\nmcts_%s_count %llu\n",
+                name, h->sum * scale, name, (unsigned long long)h->count);
+}
+
+static void
+make_metrics(blob *b)
+{
+    uint64_t in = mccp_in, out = mccp_out, queued = 0;
+    int i, connections = 0;
+
+    for(i = 0; i < high_fd; i++) {
+	if(!clients[i].is_connected || clients[i].http) continue;
+	connections++;
+	queued += clients[i].writelen;
+#if HAVE_ZLIB
+	if(clients[i].stream) {
+	    in += clients[i].stream->total_in;
+	    out += clients[i].stream->total_out;
+	}
 #endif
+    }
+    metric(b, "connections", "gauge", "Connected clients.", connections);
+    metric(b, "accepts_total", "counter", "Accepted connections.", accepts);
+    metric(b, "received_bytes_total", "counter", "Bytes read from the clients.", bytes_in);
+    metric(b, "sent_bytes_total", "counter", "Bytes sent to the clients.", bytes_out);
+    metric(b, "mccp_in_bytes_total", "counter", "Bytes given to MCCP.", in);
+    metric(b, "mccp_out_bytes_total", "counter", "Bytes MCCP made of them.", out);
+    metric(b, "mccp_ratio", "gauge", "MCCP's output per input byte.",
+           in ? (double)out / in : 0);
+    metric(b, "queued_bytes", "gauge", "Output waiting to be sent.", queued);
+    metric_summary(b, "queue_depth_bytes",
+                   "The output queue's length when a client became writable.",
+                   &queue_depth, 1);
+    metric(b, "dropped_clients_total", "counter",
+           "Clients that were closed for too much queued output.", dropped_clients);
+    metric(b, "idle_closed_total", "counter", "Clients that were closed for being idle.",
+           idle_reaped);
+    metric(b, "producer_pauses_total", "counter", "Floods paused at the high water mark.",
+           producer_pauses);
+    metric(b, "deferred_bytes_total", "counter", "Broadcast bytes that had to wait.",
+           deferred_bytes);
+    metric(b, "lines_total", "counter", "Lines processed.", lines_processed);
+    blob_printf(b, "# HELP mcts_commands_total Commands given, by name.\n"
+                "# TYPE mcts_commands_total counter\n");
+    for(i = 0; i < n_command_counts; i++)
+	blob_printf(b, "mcts_commands_total{command=\"%s\"} %llu\n",
+	            command_counts[i].name, (unsigned long long)command_counts[i].count);
+    blob_printf(b, "mcts_commands_total{command=\"other\"} %llu\n",
+                (unsigned long long)other_commands);
+    blob_printf(b, "# HELP mcts_syscalls_total System calls, by kind.\n"
+                "# TYPE mcts_syscalls_total counter\n");
+    for(i = 0; i < sc_count; i++)
+	blob_printf(b, "mcts_syscalls_total{call=\"%s\"} %llu\n",
+	            syscall_names[i], (unsigned long long)syscalls[i]);
+    metric_summary(b, "loop_seconds",
+                   "The time from a wakeup of the event loop to its next wait.",
+                   &loop_time, 1e-9);
+    metric(b, "stalls_total", "counter", "Loop turns that took longer than -S ms.",
+           stalls);
 }
 
+/* Answer the request when its headers are in */
 static void
-test_text(int fd, char *args)
+http_input(int clinr)
 {
-    switch(atoi(args)) {
-	case 1:
-	    simple_write(fd, "First line\r\n");
-	    server_prompt(fd, "> ", 2);
-	    sleep(1);
-	    server_write(fd, "\r", 2, 0);
-	    simple_write(fd, "Second line\r\nThere should no longer be a > character between the first and second line.\r\n");
-	    break;
-	case 2:
-	    simple_write(fd,
-		    "\e%@" // Select default, iso-8859-1, character set.
-		    "(iso-8859-1 charset): A single y character, with \" above it: \377\377\r\n"
-		    "Word wrapping test. The next line contains non-breaking spaces:\r\n"
-		    "In\240this\240long\240line\240of\240text,\240the\240only\240place\240where space\240is\240used\240is\240before\240the\240first\240space\240word.\r\n"
-		    );
-	    break;
-	case 3:
-	    simple_write(fd,
-		    "\e%G" // Select UTF-8 character set.
-		    "(utf-8 charset): A single a character with \" above it: \xC3\xA4 and again: a\xCC\x88\r\n"
-		    "Word wrapping test. The next line contains non-breaking spaces:\r\n"
-		    "In\302\240this\302\240long\302\240line\302\240of\302\240text,\302\240the\302\240only\302\240place\302\240where space\302\240is\302\240used\302\240is\302\240before\302\240the\302\240first\302\240space\302\240word.\r\n"
-		    );
-	    break;
-	case 4:
-	    simple_write(fd, "This test assumes the screen is 80 characters wide.\r\n"
-		    "This 80 character line should not be wrapped. The line should properly end here.\r\n"
-		    "This 81 character line should be wrapped. Xyzzy hocus pocus plugh shazam alakazam\r\n"
-		    "This 81 character line should also be wrapped. Abracadabra plugh plover alakazam.\r\n"
-		    "This 81 character line should be wrapped too.  Klaatu barada nikto!  Hocus-pocus.\r\n"
-		    "This 81 character line should be wrapped as well. Klaatu barada nikto hocus-pocus\r\n"
-		    );
-	    break;
-	case 5:
-	    simple_write(fd,
-		    "Backspace is destructive NOT!\010\010\010\010\r\n"
-		    "\r\n"
-		    "\0103\r\n"
-		    "\r\n"
-		    "\r\n"
-		    "\"3\" should be in the first column and there should be a blank\r\n"
-		    "line between the \"Backspace is...\" text and the line with \"3\".\r\n"
-		    "The first line should end with \"NOT!\"\r\n"
-		    );
-	    simple_write(fd, "Backspace is destructive NOT!\010\010\010\010\r\n");
+    static blob body;
+    struct iovec iov[2];
+    Clients *c = &clients[clinr];
+    const char *status = "200 OK";
+    uint32_t i;
+
+    if(c->http_done) {
+	c->inpos = c->inlen;
+	return;
+    }
+    for(i = 1; i < c->inlen; i++) {
+	if(c->inbuf[i] == '\n' &&
+	   (c->inbuf[i - 1] == '\n' || (i > 1 && c->inbuf[i - 1] == '\r' &&
+	                                c->inbuf[i - 2] == '\n')))
 	    break;
-	default:
-	    simple_write(fd,
-		    "Test processing tests:\r\n"
-		    "testtext 1 - tests carriage return handling.\r\n"
-		    "testtext 2 - tests ISO-8859-1 text handling.\r\n"
-		    "testtext 3 - tests UTF-8 text handling.\r\n"
-		    "testtext 4 - more word wrapping tests\r\n"
-		    "testtext 5 - Backspace testing.\r\n"
-		    );
     }
+    if(i >= c->inlen) {
+	if(c->inlen >= 8192)
+	    c->mode |= SM_QUITING;
+	return;
+    }
+    body.len = 0;
+    if((i > 13 && !memcmp(c->inbuf, "GET /metrics ", 13)) ||
+       (i > 6 && !memcmp(c->inbuf, "GET / ", 6))) {
+	make_metrics(&body);
+    } else {
+	status = "404 Not Found";
+	blob_printf(&body, "Try /metrics\n");
+    }
+    iov[0].iov_base = debug_buffer;
+    iov[0].iov_len = snprintf(debug_buffer, sizeof(debug_buffer),
+                              "HTTP/1.0 %s\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %d\r\n"
+                              "Connection: close\r\n\r\n", status, body.len);
+    iov[1].iov_base = body.data;
+    iov[1].iov_len = body.len;
+    server_writev(clinr, iov, 2, 0);
+    c->inpos = c->inlen;
+    c->http_done = true;
 }
 
-
 static int
 get_port(struct sockaddr_storage *addr)
 {
@@ -2803,10 +6921,17 @@ ident(int fd)
     socklen_t alen;
     char buff[256];
     int our_port;
+    int s;
+
+    if(clients[fd].address.ss_family != AF_INET &&
+       clients[fd].address.ss_family != AF_INET6) {
+	simple_write(fd, "ident needs a TCP connection\r\n");
+	return;
+    }
 #ifdef PF_INET6
-    int s = socket((clients[fd].address.ss_family == AF_INET) ? PF_INET : PF_INET6, SOCK_STREAM, 0);
+    s = socket((clients[fd].address.ss_family == AF_INET) ? PF_INET : PF_INET6, SOCK_STREAM, 0);
 #else
-    int s = socket(PF_INET, SOCK_STREAM, 0);
+    s = socket(PF_INET, SOCK_STREAM, 0);
 #endif
 
     if(s == -1) {
@@ -2864,10 +6989,11 @@ ident(int fd)
 }
 
 static void
-process_line(int fd, char *line)
+process_line(int fd, char *line, int len)
 {
-    char *s = line + strlen(line);
+    char *s = line + len;
     char *args = "";
+    const char *command;
     simple_write(fd, "\r\n");
     while(*line == ' ') line++;
     while(s > line && s[-1] == ' ') s--;
@@ -2879,6 +7005,7 @@ process_line(int fd, char *line)
         while(*s == ' ') s++;
         args = s;
     }
+    command = line;
     if(!strcmp("?", line) ||
             !strcasecmp("help", line)) {
         simple_write(fd,
@@ -2888,42 +7015,41 @@ process_line(int fd, char *line)
                 "colourshow256 - show the 256 xterm colours.\r\n"
                 "eall <text> - sends text to all connected clients (without a prompt afterwards).\r\n"
                 "echo - turn server echo on/off.\r\n"
+                "flood <bytes> [<pattern>] - send lots of output, as fast as the client reads it.\r\n"
 		"ident - try to look up the user id via IDENT, RFC1413\r\n"
+		"prof [reset] - show the time spent in the hot paths, with \"make profile\".\r\n"
 		"promptall <text> - send text to all connected clients without newline\r\n"
                 "quit - leave\r\n"
                 "sendasis <string> - send the string back on a new line.\r\n"
                 "senddata <hex byte>* - send the bytes back.\r\n"
 		"set <variable> <value> - set a variable.\r\n"
                 "startmsp - start telnet msp option negotiation.\r\n"
+                "stats - show the server's statistics.\r\n"
                 "startmxp - start telnet mxp option negotiation.\r\n"
                 "stopmccp - finish the zlib stream.\r\n"
                 "telnet - Hex codes for some telnet constants.\r\n"
                 "testansi - Various ANSI colour tests.\r\n"
                 "testcc - Various control code sequence tests.\r\n"
                 "testtext - Various text tests.\r\n"
+                "tilestorm <fps> [<seconds>] [<width>x<height>] [<percent>] - NetHack tile map frames.\r\n"
                 "tt - Ask the client for the next terminal type.\r\n"
                 "zmp <cmd> [<args>|\"<arg>\"]* - send a ZMP command.\r\n"
+                "zmpecho <rate> [<count>] - time ZMP messages that the client echoes.\r\n"
                 );
+        {
+            const scenario *sc;
+            for(sc = scenarios; sc; sc = sc->next) {
+                if(*sc->args ||
+                   !strcasecmp(sc->command, "testcc") ||
+                   !strcasecmp(sc->command, "testtext"))
+                    continue;
+                snprintf(debug_buffer, sizeof(debug_buffer), "%s - %s\r\n",
+                         sc->command, sc->description);
+                simple_write(fd, debug_buffer);
+            }
+        }
     } else if(!strcasecmp("cat", line)) {
-	int max = atoi(args);
-	if(!max) max = 1<<30;
-	int f = open("test.txt", O_RDONLY);
-	if(!f) {
-	    perror("test.txt");
-	    simple_write(fd, "Could not find test.txt\r\n");
-	} else {
-	    char buff[4096];
-	    int len;
-	    while(max && (len = read(f, buff, sizeof(buff))) > 0) {
-		int i;
-		for(i = 0; i < len && max--; i++) {
-		    if(buff[i] == '\n') {
-			server_write(fd, "\r\n", 2, 0);
-		    } else server_write(fd, buff+i, 1, 0);
-		}
-	    }
-	    close(f);
-	}
+        handle_cat(fd, args);
     } else if(!strcasecmp("colourshow", line) ||
               !strcasecmp("colorshow", line)) {
         colour_show(fd);
@@ -2940,44 +7066,28 @@ process_line(int fd, char *line)
 		"under certain conditions.\r\n");
 
     } else if(!strcasecmp("eall", line)) {
-	int i;
-	for(i = 0; i < high_fd; i++) {
-	    if(clients[i].is_connected) {
-		simple_write(i, args);
-		simple_write(i, "\r\n");
-	    }
-	}
+	broadcast(args);
+	broadcast("\r\n");
     } else if(!strcasecmp("promptall", line)) {
-	int i;
-	for(i = 0; i < high_fd; i++) {
-	    if(clients[i].is_connected) {
-		simple_write(i, args);
-	    }
-	}
+	broadcast(args);
     } else if(!strcasecmp("echo", line)) {
         if(clients[fd].mode & SM_INVISIBLE) {
             server_visible(fd);
         } else {
             server_invisible(fd);
         }
+    } else if(!strcasecmp("flood", line)) {
+        handle_flood(fd, args);
     } else if(!strcasecmp("ident", line)) {
 	simple_write(fd, "(processing)\r\n");
 	ident(fd);
     } else if(!strcasecmp("quit", line)) {
         char buffer[100];
         simple_write(fd, "Bwye!\r\n");
+        /* The command is in the line, server_close() frees it */
+        count_command(command);
         server_close(fd);
-        buffer[0] = 0;
-#ifdef NI_NUMERICHOST
-        getnameinfo((const struct sockaddr *)&clients[fd].address,
-                    clients[fd].address_len,
-                    buffer, sizeof(buffer),
-                    NULL, 0,
-                    NI_NUMERICHOST);
-#else
-	strcpy(buffer, "unknown");
-#endif
-        buffer[sizeof(buffer)-1] = 0;
+        client_address(fd, buffer, sizeof(buffer));
         printf("%s disconnected (quit, fd=%d)\n", buffer, fd);
         return;
     } else if(!strcasecmp("sendasis", line)) {
@@ -2991,6 +7101,10 @@ process_line(int fd, char *line)
         telnet_enable_us_option(fd, MSPc);
     } else if(!strcasecmp("startmxp", line)) {
         telnet_enable_us_option(fd, MXPc);
+    } else if(!strcasecmp("prof", line)) {
+        handle_prof(fd, args);
+    } else if(!strcasecmp("stats", line)) {
+        handle_stats(fd);
     } else if(!strcasecmp("stopmccp", line)) {
         server_write(fd, "Stopping MCCP\r\n", 15, SW_FINISH|SW_DO_FLUSH);
     } else if(!strcasecmp("telnet", line)) {
@@ -3005,21 +7119,33 @@ process_line(int fd, char *line)
         server_prompt(fd, "special prompt> ", 16);
 	int delay = atoi(args);
 	if(delay <= 0) delay = 1;
+        server_flush(fd);
         sleep(delay);
         server_write(fd, "\r", 2, 0); /* Yes 2 in length! */
         simple_write(fd, "\e");
+        server_flush(fd);
         sleep(delay);
         simple_write(fd, "[31mStill bright red\r\n"
                          "\e[mBack to the default colour.\r\n");
-    } else if(!strcasecmp("testtext", line)) {
-	test_text(fd, args);
-    } else if(!strcasecmp("testcc", line)) {
-        test_cc(fd, args);
+    } else if(!strcasecmp("testtext", line) && !strcmp(args, "4") &&
+              clients[fd].x_size) {
+        wrap_test(fd);
+    } else if(!strcasecmp("testtext", line) ||
+              !strcasecmp("testcc", line)) {
+        if(!run_scenario_command(fd, line, args))
+            simple_write(fd, "No such tests were found in the scenario file.\r\n");
+    } else if(!strcasecmp("tilestorm", line)) {
+        handle_tilestorm(fd, args);
     } else if(!strcasecmp("tt", line)) {
         telnet_turned_on_him_option(fd, TTc);
     } else if(!strcasecmp("zmp", line)) {
         handle_zmp(fd, args);
+    } else if(!strcasecmp("zmpecho", line)) {
+        handle_zmpecho(fd, args);
+    } else if(*line && run_scenario_command(fd, line, args)) {
+        /* A command from the scenario file */
     } else if(*line) {
+        command = "unknown";
         simple_write(fd, "Unknown command: ");
         while(*line) {
             if(*line == IACc) server_write(fd, IAC, 1, 0);
@@ -3027,74 +7153,389 @@ process_line(int fd, char *line)
         }
         simple_write(fd, "\r\n");
     }
-    server_prompt(fd, "> ", 2);
+    if(*command)
+        count_command(command);
+    if(clients[fd].producer) {
+        /* The producer sends the prompt when it is done */
+        run_producer(fd);
+    } else {
+        server_prompt(fd, "> ", 2);
+    }
+}
+
+/* scenarios.txt in the current directory, or else the one next to
+ * the binary */
+static const char *
+default_scenario_file(const char *argv0)
+{
+    static char path[PATH_MAX];
+    char exe[PATH_MAX];
+    const char *slash;
+    ssize_t n;
+
+    if(!access("scenarios.txt", R_OK))
+        return "scenarios.txt";
+    n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if(n > 0) {
+        exe[n] = 0;
+        argv0 = exe;
+    }
+    if(!(slash = strrchr(argv0, '/')))
+        return "scenarios.txt";
+    snprintf(path, sizeof(path), "%.*s/scenarios.txt", (int)(slash - argv0), argv0);
+    return path;
+}
+
+static void
+handle_stop_signal(int sig)
+{
+    stop_requested = 1;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [port]\n"
+            "  -r, --record <file>  record all traffic to <file>, see mcts-replay.\n"
+            "  -s, --scenarios <file>  read the test scenarios from <file>,\n"
+            "                       default scenarios.txt here or next to\n"
+            "                       the binary.\n"
+            "  -W, --high-water <bytes>  pause a client's floods when this much\n"
+            "                       output is queued, default 64k.\n"
+            "  -L, --low-water <bytes>  resume them when the queue is this short,\n"
+            "                       default 16k.\n"
+            "  -D, --drop-at <bytes>  disconnect a client when this much output\n"
+            "                       is queued, default 1m.\n"
+            "  -l, --max-line <bytes>  the longest line that is read from a\n"
+            "                       client, default 16k.\n"
+            "  -b, --backlog <n>    the listen queue's length, default %d.\n"
+            "  -e, --backend <name>  wait for the sockets with select, epoll or\n"
+            "                       io_uring. The best one there is by default.\n"
+            "  -i, --idle <seconds>  close the clients that have sent nothing\n"
+            "                       for this long, default never.\n"
+            "  -k, --keepalive <seconds>  send IAC NOP to the clients that have\n"
+            "                       been quiet for this long.\n"
+            "  -K, --tcp-keepalive <seconds>  turn on TCP keepalive probes after\n"
+            "                       this long.\n"
+            "  -S, --stall <ms>     log the turns of the event loop that take\n"
+            "                       longer than this, default %d.\n"
+            "  -a, --address <address>[:<port>][,<option>=<value>]...\n"
+            "                       listen there, instead of on all IPv4 and\n"
+            "                       IPv6 addresses. May be given more than once,\n"
+            "                       IPv6 addresses are written in brackets and\n"
+            "                       the options are the ones of -T.\n"
+            "  -u, --unix <path>[,<option>=<value>]...  also listen on a unix\n"
+            "                       socket, the same as -a unix:<path>. Only the\n"
+            "                       sndbuf and rcvbuf options are used there.\n"
+            "  -M, --metrics <port>  answer HTTP requests for the server's\n"
+            "                       metrics on this port on 127.0.0.1.\n"
+            "  -T, --tcp <option>=<value>  set a socket option for all clients,\n"
+            "                       nodelay, quickack, sndbuf, rcvbuf or\n"
+            "                       notsentlowat. The clients can change them\n"
+            "                       with \"set\".\n"
+            "      --stdio          run one session on stdin and stdout instead\n"
+            "                       of listening, the log goes to stderr. It\n"
+            "                       ends when stdin is closed and all output\n"
+            "                       is written.\n"
+            "  -h, --help           show this text.\n"
+            "The default port is 5445.\n", name, LISTEN_BACKLOG, STALL_MS);
 }
 
+/* The long options that have no short one */
+#define OPT_STDIO 256
+
 int
 main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        { "record", required_argument, NULL, 'r' },
+        { "scenarios", required_argument, NULL, 's' },
+        { "high-water", required_argument, NULL, 'W' },
+        { "low-water", required_argument, NULL, 'L' },
+        { "drop-at", required_argument, NULL, 'D' },
+        { "max-line", required_argument, NULL, 'l' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "backend", required_argument, NULL, 'e' },
+        { "idle", required_argument, NULL, 'i' },
+        { "keepalive", required_argument, NULL, 'k' },
+        { "tcp-keepalive", required_argument, NULL, 'K' },
+        { "tcp", required_argument, NULL, 'T' },
+        { "metrics", required_argument, NULL, 'M' },
+        { "stall", required_argument, NULL, 'S' },
+        { "address", required_argument, NULL, 'a' },
+        { "unix", required_argument, NULL, 'u' },
+        { "stdio", no_argument, NULL, OPT_STDIO },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *record_file = NULL;
+    const char *scenario_file = NULL;
+    const char *backend_name = NULL;
     int port = 5445;
+    int metrics_port = 0;
+    const char *addresses[MAX_LISTENERS];
+    int n_addresses = 0;
+    const char *unix_paths[MAX_LISTENERS];
+    int n_unix_paths = 0;
+    bool use_stdio = false;
+    int opt, i;
+    struct sigaction sa;
+
+    while((opt = getopt_long(argc, argv, "r:s:W:L:D:l:b:e:i:k:K:T:M:S:a:u:h", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'r':
+                record_file = optarg;
+                break;
+            case 's':
+                scenario_file = optarg;
+                break;
+            case 'W':
+                default_high_water = parse_size(optarg);
+                break;
+            case 'L':
+                default_low_water = parse_size(optarg);
+                break;
+            case 'D':
+                default_drop_at = parse_size(optarg);
+                break;
+            case 'l':
+                max_line = parse_size(optarg);
+                if(max_line < 1) max_line = 1;
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'e':
+                backend_name = optarg;
+                break;
+            case 'i':
+                default_idle_timeout = atoi(optarg);
+                if(default_idle_timeout < 0) default_idle_timeout = 0;
+                break;
+            case 'k':
+                keepalive_interval = atoi(optarg);
+                if(keepalive_interval < 0) keepalive_interval = 0;
+                break;
+            case 'K':
+                tcp_keepalive = atoi(optarg);
+                if(tcp_keepalive < 0) tcp_keepalive = 0;
+                break;
+            case 'M':
+                metrics_port = atoi(optarg);
+                break;
+            case 'S':
+                stall_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'T':
+                if(!parse_tcp_option(optarg, default_tcp)) {
+                    fprintf(stderr, "-T wants nodelay, quickack, sndbuf, rcvbuf"
+                            " or notsentlowat, =, and a value\n");
+                    exit(1);
+                }
+                break;
+            case 'a':
+                if(n_addresses == MAX_LISTENERS) {
+                    fprintf(stderr, "There can be at most %d listeners\n", MAX_LISTENERS);
+                    exit(1);
+                }
+                addresses[n_addresses++] = optarg;
+                break;
+            case 'u':
+                if(n_unix_paths == MAX_LISTENERS) {
+                    fprintf(stderr, "There can be at most %d listeners\n", MAX_LISTENERS);
+                    exit(1);
+                }
+                unix_paths[n_unix_paths++] = optarg;
+                break;
+            case OPT_STDIO:
+                use_stdio = true;
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if(optind < argc) {
+        port = atoi(argv[optind]);
+    }
+
+    if(use_stdio) {
+        /* The session has stdout, the log is written to stderr */
+        stdio_out = dup(STDOUT_FILENO);
+        if(stdio_out < 0 || stdio_out >= FD_SETSIZE ||
+           dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("--stdio");
+            exit(1);
+        }
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        if(backend_name && strcmp(backend_name, "select")) {
+            fprintf(stderr, "--stdio only works with select\n");
+            exit(1);
+        }
+        /* epoll and io_uring can't wait for all kinds of files */
+        backend_name = "select";
+    }
+
     signal(SIGPIPE, SIG_IGN);
-    if(argc > 1) {
-        port = atoi(argv[1]);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+#if MCTS_PROFILE
+    sa.sa_handler = handle_prof_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+#endif
+
+    if(!scenario_file)
+        scenario_file = default_scenario_file(argv[0]);
+    if(!load_scenarios(scenario_file)) {
+        /* Without it testcc and testtext have nothing to send */
+        perror(scenario_file);
+        exit(1);
+    }
+    make_connect_blob();
+    make_colour_blobs();
+    {
+	/* Make room for as many connections as the backend can wait
+	 * for, if we may. All fds are below the limit. */
+	struct rlimit rl;
+	rlim_t want = backend_name && !strcmp(backend_name, "select") ?
+		      FD_SETSIZE : MAX_FD;
+	max_fd = FD_SETSIZE;
+	if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+	    if(rl.rlim_cur < want) {
+		rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	    }
+	    max_fd = rl.rlim_cur < want ? rl.rlim_cur : want;
+	}
+	clients = calloc(max_fd, sizeof(*clients));
+	if(!clients) {
+	    perror("calloc");
+	    exit(1);
+	}
+#if HAVE_IO_URING
+	accepted = calloc(max_fd, sizeof(*accepted));
+	if(!accepted) {
+	    perror("calloc");
+	    exit(1);
+	}
+#endif
     }
-    if(server_init(port) <= 0) {
-        perror("Could not open the server port: ");
+    for(i = 0; i < n_addresses && !use_stdio; i++)
+        if(!listener_open(addresses[i], port, listen_telnet))
+            exit(1);
+    if(!n_addresses && !use_stdio) {
+        if(!listener_open("0.0.0.0", port, listen_telnet))
+            exit(1);
+        /* There might be no IPv6, that is fine */
+        listener_open("::", port, listen_telnet);
+    }
+    for(i = 0; i < n_unix_paths && !use_stdio; i++) {
+        char spec[160];
+        snprintf(spec, sizeof(spec), "unix:%s", unix_paths[i]);
+        if(!listener_open(spec, port, listen_telnet))
+            exit(1);
+    }
+    if(metrics_port && !listener_open("127.0.0.1", metrics_port, listen_metrics))
         exit(1);
+    if(!backend_init(backend_name)) {
+        fprintf(stderr, "The %s backend can not be used\n", backend_name);
+        exit(1);
+    }
+    if(backend == backend_select && max_fd > FD_SETSIZE)
+        max_fd = FD_SETSIZE;
+    if(record_file) {
+        if(!record_start(record_file))
+            exit(1);
+        printf("Recording all traffic to %s\n", record_file);
     }
-    printf("The server is now listening on port %d\n", daemon_port);
-    while(1) {
-        if(server_poll(60, 0) > 0) {
-            int fd;
+    if(use_stdio) {
+        char empty[1] = "";
+        printf("The session is on stdin and stdout, with %s\n",
+               backend_names[backend]);
+        process_line(stdio_start(), empty, 0);
+    } else {
+        printf("The server is now listening on");
+        for(i = 0; i < n_listeners; i++)
+            if(listeners[i].kind == listen_telnet)
+                printf(" %s", listeners[i].name);
+        printf(", with %s\n", backend_names[backend]);
+    }
+    for(i = 0; i < n_listeners; i++)
+        if(listeners[i].kind == listen_metrics)
+            printf("Metrics at http://%s/metrics\n", listeners[i].name);
+    while(!stop_requested) {
+        uint64_t started = now_ns();
+        int wait = run_timers();
+        loop_work(-1, "timers", now_ns() - started);
+#if MCTS_PROFILE
+        if(prof_requested) {
+            prof_requested = 0;
+            prof_report(-1);
+        }
+#endif
+        if(server_poll(wait < 0 ? 60 : wait / 1000,
+                       wait < 0 ? 0 : (wait % 1000) * 1000) > 0) {
+            int fd, i, n;
             if(server_pending()) {
-                fd = server_accept();
-                if(fd >= 0) {
+                while((fd = server_accept()) >= 0) {
                     char buffer[100];
-                    buffer[0] = 0;
-#ifdef NI_NUMERICHOST
-                    getnameinfo((const struct sockaddr *)&clients[fd].address,
-                                clients[fd].address_len,
-                                buffer, sizeof(buffer),
-                                NULL, 0,
-                                NI_NUMERICHOST);
-#else
-		    strcpy(buffer, "unknown");
-#endif
-                    buffer[sizeof(buffer)-1] = 0;
+                    client_address(fd, buffer, sizeof(buffer));
                     printf("%s connected (fd=%d)\n", buffer, fd);
-                    simple_write(fd, "\r\n" "\r\n"
-                                     "Welcome to the Mud Client Test Server!\r\n"
-                                     "Server version: " VERSION
-				     " compiled at "
-                                     __DATE__ "\r\n" "\r\n"
-                                     "Write ? for help\r\n" "\r\n");
                     char empty[1];
                     empty[0]=0;
-                    process_line(fd, empty);
+                    process_line(fd, empty, 0);
                 }
             }
-            for(fd = 0; fd < high_fd; fd++) {
-                if(server_ready(fd)) {
-                    char *line = server_read(fd);
+            n = high_fd;
+            for(i = 0; i < n; i++) {
+                int lines = 0;
+                fd = (next_turn + i) % n;
+                if(!server_ready(fd))
+                    continue;
+                clients[fd].deficit += TURN_QUANTUM;
+                server_cork(fd);
+                /* After the first line, the batch also ends when the
+                 * output queue is full. */
+                while(lines < LINE_QUOTA && clients[fd].deficit > 0 &&
+                      (!lines || clients[fd].writelen < clients[fd].high_water) &&
+                      server_ready(fd)) {
+                    int len, queued = clients[fd].writelen;
+                    char *line = server_read(fd, &len);
                     if(!line) {
                         char buffer[100];
                         server_close(fd);
-                        buffer[0] = 0;
-#ifdef NI_NUMERICHOST
-                        getnameinfo((const struct sockaddr *)&clients[fd].address,
-                                    clients[fd].address_len,
-                                    buffer, sizeof(buffer),
-                                    NULL, 0,
-                                    NI_NUMERICHOST);
-#else
-			strcpy(buffer, "unknown");
-#endif
-                        buffer[sizeof(buffer)-1] = 0;
+                        client_address(fd, buffer, sizeof(buffer));
                         printf("%s disconnected (fd=%d)\n", buffer, fd);
-                    } else process_line(fd, line);
+                        break;
+                    }
+                    started = now_ns();
+                    PROF_START(process_line);
+                    process_line(fd, line, len);
+                    PROF_END(process_line);
+                    if(clients[fd].is_connected)	/* quit frees the line */
+                        loop_work(fd, line, now_ns() - started);
+                    lines++;
+                    clients[fd].deficit -= len;
+                    if(clients[fd].writelen > queued)
+                        clients[fd].deficit -= clients[fd].writelen - queued;
                 }
+                if(lines)
+                    hist_add(&batch_size, lines);
+                if(!server_ready(fd) && clients[fd].deficit > 0)
+                    clients[fd].deficit = 0;
+                server_uncork(fd);
             }
+            if(n)
+                next_turn = (next_turn + 1) % n;
         }
     }
+    server_shutdown();
+    record_stop();
     return 0;
 }
@@ -0,0 +1,73 @@
+/*
+ * Mud Client Test Server. Copyright 2006, 2007, 2009 Sebastian Andersson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The format of the files written by "mcts -r <file>" and read
+ * by mcts-replay.
+ *
+ * The file starts with the REC_MAGIC string and is then followed by
+ * packets. Every packet starts with a REC_HEADER_LEN bytes long header:
+ *   8 bytes - CLOCK_MONOTONIC time in nanoseconds.
+ *   4 bytes - the client's session number, unique for each connection.
+ *   4 bytes - the number of data bytes that follow the header.
+ *   1 byte  - the type of the packet, one of the REC_* values.
+ * All numbers are stored in network byte order.
+ */
+#ifndef MCTS_RECORD_H
+#define MCTS_RECORD_H
+
+#include <stdint.h>
+
+#define REC_MAGIC "MCTSREC1"
+#define REC_MAGIC_LEN 8
+#define REC_HEADER_LEN 17
+
+#define REC_CONNECT 0	/* A new client. The data is its numeric address */
+#define REC_IN      1	/* Data received from the client */
+#define REC_OUT     2	/* Data sent to the client */
+#define REC_CLOSE   3	/* The connection was closed. No data */
+
+static inline void
+rec_put(unsigned char *p, uint64_t value, int bytes)
+{
+    while(bytes--) {
+        p[bytes] = value & 255;
+        value >>= 8;
+    }
+}
+
+static inline uint64_t
+rec_get(const unsigned char *p, int bytes)
+{
+    uint64_t value = 0;
+    while(bytes--) {
+        value = (value << 8) | *p++;
+    }
+    return value;
+}
+
+static inline void
+rec_put_header(unsigned char *p, uint64_t time, uint32_t session,
+               uint32_t len, int type)
+{
+    rec_put(p, time, 8);
+    rec_put(p + 8, session, 4);
+    rec_put(p + 12, len, 4);
+    p[16] = type;
+}
+
+#endif